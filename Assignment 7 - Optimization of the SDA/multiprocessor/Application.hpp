@@ -13,6 +13,18 @@
 #define TARGET_PTHREAD  3       // Pthreads on CPU
 #define TARGET_OMP      4       // Threads on CPU using OpenMP
 
+/* These are the options for ZNCC_KERNEL. */
+#define ZNCC_SIMPLE     0       // calc_zncc: each pixel straight from global memory
+#define ZNCC_TILED      1       // calc_zncc_tiled: tiles and window sums in local memory
+#define ZNCC_VEC        2       // calc_zncc_vec: blocks of 8 disparities with vector loads
+#define ZNCC_PAIR       3       // calc_zncc_lr: both disparity maps in one launch
+
+/* These are the options for OCCLUSION_FILL. */
+#define FILL_LEFT       0       // nearest non-zero pixel on the left
+#define FILL_NEAREST    1       // nearest non-zero pixel in the 8 directions
+#define FILL_EUCLIDEAN  2       // nearest non-zero pixel in any direction
+#define FILL_DEFAULT    3       // FILL_NEAREST with OpenCL, FILL_LEFT otherwise
+
 ///////////////////////////////////////////////////////////////////////////////
 // Parameters:
 ///////////////////////////////////////////////////////////////////////////////
@@ -34,6 +46,140 @@
  */
 #define NUM_THREADS 8
 
+/**
+ * If 1, the input images are decoded straight to grayscale (GrayImage) at load
+ * time instead of RGBA. This cuts the memory usage of loading and the amount
+ * of data to be processed when downscaling to a quarter.
+ */
+#define LOAD_AS_GRAYSCALE 1
+
+/**
+ * If 1, the images are downscaled and converted to grayscale in a single
+ * pass (area averaging) instead of blurring, decimating and converting.
+ */
+#define FUSED_DOWNSCALE 1
+
+/**
+ * If 1, the whole pipeline (downscaling to the final disparity map) is run
+ * with a single call to Image::calcStereoDisparity(). With OpenCL, nothing
+ * but the final map is read back, so no intermediate images are saved.
+ */
+#define FUSED_PIPELINE 0
+
+/**
+ * If 1, the cross-checked disparity map is calculated directly by comparing
+ * both directions of each pixel right away (Image::calcZNCCCrossChecked),
+ * instead of calculating two full disparity maps and cross-checking them.
+ * The disparity maps of both directions are then not saved.
+ */
+#define FUSED_CROSS_CHECK 0
+
+/**
+ * Directory where the built OpenCL program binaries are cached between runs.
+ * Set to "" to always build the kernels from source.
+ */
+#define OCL_CACHE_DIR "cl-cache"
+
+/**
+ * Maximum amount of unused OpenCL buffers (in bytes) kept for reuse.
+ * Buffers released beyond this are freed immediately.
+ */
+#define OCL_POOL_LIMIT (256 * 1024 * 1024)
+
+/**
+ * File where the best OpenCL work-group (local) sizes found by the autotuner
+ * are stored per device, kernel (variant) and problem size. Set to "" to
+ * disable the tuning and always use 16x16 (or the largest size the kernel
+ * supports). The tuning reruns the kernels launched with OCL_LOCAL_AUTO on a
+ * band of their rows, so those kernels must not work in place.
+ */
+#define OCL_TUNING_FILE "cl-tuning.txt"
+
+/**
+ * File where the OpenCL profile (device time of each pipeline stage split to
+ * compute, transfers and queueing) is exported as CSV. Set to "" to only
+ * print the profile.
+ */
+#define OCL_PROFILE_FILE "cl-profile.csv"
+
+/**
+ * If 1, the ZNCC kernels are built separately for the window size, direction
+ * and search range in use, with the parameters as compile-time constants
+ * (see kernels.cl). Each variant is built (or loaded from OCL_CACHE_DIR) once.
+ */
+#define OCL_SPECIALIZE_KERNELS 1
+
+/**
+ * Whether to split the ZNCC calculation across all the OpenCL devices of all
+ * the platforms (e.g. CPU and GPU), in proportion to their measured speed.
+ * The other stages still run on the TARGET_DEVICE_TYPE device.
+ */
+#define OCL_MULTI_DEVICE 0
+
+/**
+ * If 1, the images between the stages (grayscale, disparity maps and
+ * cross-checked) are saved to disk. With OpenCL, the images otherwise stay on
+ * the device and only the final image is read back.
+ */
+#define SAVE_INTERMEDIATE_IMAGES 1
+
+/**
+ * ZNCC_KERNEL options (OpenCL only):
+ * ZNCC_SIMPLE     = calc_zncc
+ * ZNCC_TILED      = calc_zncc_tiled, falls back to calc_zncc if the tiles
+ *                   do not fit in the local memory of the device or the
+ *                   device cannot run the kernel in 16x16 work-groups
+ * ZNCC_VEC        = calc_zncc_vec
+ * ZNCC_PAIR       = calc_zncc_lr (left and right maps in a single launch)
+ * The other kernels have not been measured against calc_zncc on a device
+ * yet, so calc_zncc stays the default.
+ */
+#define ZNCC_KERNEL ZNCC_SIMPLE
+
+/**
+ * OCCLUSION_FILL options:
+ * FILL_LEFT       = occlusion_scan_left (OpenCL), a row walk (host)
+ * FILL_NEAREST    = occlusion_scan_lines + occlusion_scan_resolve (OpenCL),
+ *                   the same scans (host); the nearest in the 8 directions
+ *                   (a spiral search along rows, columns and diagonals)
+ * FILL_EUCLIDEAN  = an exact Euclidean distance transform, the nearest pixel
+ *                   in any direction (on the host, also with OpenCL;
+ *                   threaded over the rows and columns with OpenMP only)
+ * FILL_DEFAULT    = FILL_NEAREST with OpenCL and FILL_LEFT otherwise, like
+ *                   the original implementations
+ */
+#define OCCLUSION_FILL FILL_DEFAULT
+
+/**
+ * Regions of at most SPECKLE_SIZE pixels in the cross-checked disparity map
+ * are removed (filled by the occlusion filling) as speckles. The neighbouring
+ * pixels of a region differ by at most SPECKLE_TOLERANCE. 0 skips the
+ * removal, so the output is the same as before; e.g. 50 removes the small
+ * islands left by the cross-checking. The regions are labeled on the host, so
+ * with OpenCL the map is read back for it. The labeling is threaded over
+ * bands of rows with OpenMP (TARGET_OMP) only; TARGET_PTHREAD threads just
+ * the ZNCC, so there it runs on one thread.
+ */
+#define SPECKLE_SIZE 0
+#define SPECKLE_TOLERANCE 2
+
+/**
+ * Radius of the median filter applied to the disparity map after the
+ * occlusion filling, i.e. the window is (2 * MEDIAN_RADIUS + 1)^2 pixels.
+ * 0 skips the filtering, so the output is the occlusion filled map as before;
+ * 2 smooths out the streaks left by the filling. On the host, the filter is
+ * threaded over column strips with OpenMP (TARGET_OMP) only; TARGET_PTHREAD
+ * threads just the ZNCC, so there it runs on one thread.
+ */
+#define MEDIAN_RADIUS 0
+
+/**
+ * Largest median filter radius done with the median_filter kernel (OpenCL).
+ * Larger windows are filtered on the host with a sliding histogram, whose
+ * cost per pixel does not depend on the radius.
+ */
+#define MEDIAN_OCL_MAX_RADIUS 3
+
 ///////////////////////////////////////////////////////////////////////////////
 // DEFINITIONS & MACROS
 ///////////////////////////////////////////////////////////////////////////////
@@ -51,3 +197,12 @@
 #elif COMPUTE_DEVICE == TARGET_OMP
 # define USE_OMP
 #endif
+
+#if OCCLUSION_FILL == FILL_DEFAULT
+# undef OCCLUSION_FILL
+# ifdef USE_OCL
+#  define OCCLUSION_FILL FILL_NEAREST
+# else
+#  define OCCLUSION_FILL FILL_LEFT
+# endif
+#endif
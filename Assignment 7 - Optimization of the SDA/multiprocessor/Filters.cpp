@@ -1,9 +1,75 @@
+#include <math.h>
 #include "Filters.hpp"
 
 ///////////////////////////////////////////////////////////////////////////////
 // FILTERS
 ///////////////////////////////////////////////////////////////////////////////
 
+/**
+ * Initializes the filter and inspects the mask to find out
+ * whether a faster special case can be used for it.
+ *
+ * @param size    Size of the mask (height or width).
+ * @param divisor The mask is divided by this.
+ * @param mask    The filter mask (size * size values).
+ */
+Filter::Filter(size_t size, float divisor, float* mask)
+    : size(size), divisor(divisor), mask(mask), uniform(true), separable(false)
+{
+    for (size_t i = 1; i < size * size; i++)
+    {
+        if (mask[i] != mask[0])
+        {
+            uniform = false;
+            break;
+        }
+    }
+
+    decompose();
+}
+
+/**
+ * Checks whether the mask is separable (rank-1), i.e. it is an outer product
+ * of a column and a row vector. If it is, the vectors are stored to colMask
+ * and rowMask so that the filter can be applied as two 1D passes.
+ */
+void Filter::decompose()
+{
+    // use the largest element as the pivot to keep the division stable
+    size_t pivot = 0;
+    for (size_t i = 1; i < size * size; i++)
+    {
+        if (fabsf(mask[i]) > fabsf(mask[pivot]))
+            pivot = i;
+    }
+
+    const float maxValue = fabsf(mask[pivot]);
+    if (maxValue == 0.0f)
+        return;
+
+    const size_t pivotRow = pivot / size;
+    const size_t pivotCol = pivot % size;
+
+    // mask[i][j] = colMask[i] * rowMask[j] where rowMask is the pivot row
+    std::vector<float> row(mask + pivotRow * size, mask + (pivotRow + 1) * size);
+    std::vector<float> col(size);
+    for (size_t i = 0; i < size; i++)
+        col[i] = mask[i * size + pivotCol] / mask[pivot];
+
+    for (size_t i = 0; i < size; i++)
+    {
+        for (size_t j = 0; j < size; j++)
+        {
+            if (fabsf(mask[i * size + j] - col[i] * row[j]) > 1e-5f * maxValue)
+                return;
+        }
+    }
+
+    separable = true;
+    rowMask = row;
+    colMask = col;
+}
+
 const size_t maskSize = 5;
 
 // Mean filter (5x5)
@@ -16,7 +82,7 @@ float meanFilterMask[maskSize * maskSize] = {
 };
 const Filter g_meanFilter(maskSize, 25.0f, meanFilterMask);
 
-// Gaussian filter (5x5)
+// Gaussian filter (5x5), not rank-1, so it is done as a 2D mask
 float gaussianFilterMask[maskSize * maskSize] = {
      1.0f,  4.0f,  7.0f,  4.0f,  1.0f,
      4.0f, 16.0f, 26.0f, 16.0f,  4.0f,
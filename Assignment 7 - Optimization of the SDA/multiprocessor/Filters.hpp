@@ -1,5 +1,8 @@
 #pragma once
 
+#include <stddef.h>
+#include <vector>
+
 ///////////////////////////////////////////////////////////////////////////////
 // FILTERS
 ///////////////////////////////////////////////////////////////////////////////
@@ -9,8 +12,14 @@ struct Filter
     const size_t size;          // size of the mask (height or width)
     const float divisor;        // the mask is divided by this
     float* mask;                // the actual filter mask
+    bool uniform;               // whether all mask values are the same (box filter)
+    bool separable;             // whether the mask is rank-1 (mask = colMask * rowMask)
+    std::vector<float> rowMask; // horizontal 1D mask (only if separable)
+    std::vector<float> colMask; // vertical 1D mask (only if separable)
+
+    Filter(size_t size, float divisor, float* mask);
 
-    Filter(size_t size, float divisor, float* mask)
-        : size(size), divisor(divisor), mask(mask) {}
+private:
+    void decompose();
 };
 typedef struct Filter Filter;
@@ -3,6 +3,45 @@
 using std::cout;
 using std::endl;
 
+/**
+ * Returns the luminance of an RGB color using the NTSC formula. The weights are
+ * in 16-bit fixed point and the result is rounded up, like in the floating
+ * point version used by convertToGrayscale.
+ */
+static inline unsigned char luminance(unsigned char r, unsigned char g, unsigned char b)
+{
+    return (unsigned char)((19595u * r + 38470u * g + 7471u * b + 0xffffu) >> 16);
+}
+
+/**
+ * Returns the root of the set containing i (union-find), halving the path on
+ * the way. The parent of each element is never larger than the element.
+ */
+static inline int findRoot(int *parent, int i)
+{
+    while (parent[i] != i)
+    {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+/**
+ * Joins the sets containing a and b (union-find). The larger root is linked
+ * to the smaller one, so that the parents always point backwards.
+ */
+static inline void unite(int *parent, int a, int b)
+{
+    a = findRoot(parent, a);
+    b = findRoot(parent, b);
+
+    if (a < b)
+        parent[b] = a;
+    else
+        parent[a] = b;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // Image
 ///////////////////////////////////////////////////////////////////////////////
@@ -20,7 +59,8 @@ Image::Image(bool singleChannel /* = false */) : singleChannel(singleChannel), w
  */
 Image::~Image()
 {
-    // ...
+    this->detachHost();
+    this->releaseDevice();
 }
 
 /**
@@ -74,8 +114,12 @@ void Image::createEmpty(size_t width, size_t height)
     this->width = width;
     this->height = height;
 
+    this->detachHost();
     this->image.clear();
     this->image.resize(this->sizeBytes(), (unsigned char)0);
+
+    this->hostValid = true;
+    this->deviceValid = false;
 }
 
 /**
@@ -93,16 +137,17 @@ void Image::replace(Image &newImage, bool forceNew /* = false */)
         this->createEmpty(newImage.width, newImage.height);
     }
 
+    this->detachHost();
     this->image = std::move(newImage.image);
-}
 
-/**
- * Load PNG file from disk to memory first, then decode to raw pixels in memory.
- * Returns true on success, false on fail.
- **/
+    this->hostValid = true;
+    this->deviceValid = false;
+}
 
 /**
  * Load PNG file from disk to memory first, then decode to raw pixels in memory.
+ * If the image is single channel (e.g. GrayImage), the PNG is decoded straight
+ * to grayscale row by row (see decodeGray).
  * Returns true on success, false on fail.
  * 
  * @param filename Name of the image file to be loaded.
@@ -115,6 +160,8 @@ bool Image::load(const std::string &filename)
     unsigned err;
     std::vector<unsigned char> png;
 
+    this->detachHost();
+
     // load and decode
     cout << "Loading image... ";
     err = lodepng::load_file(png, filename);
@@ -127,14 +174,18 @@ bool Image::load(const std::string &filename)
 
     cout << "Decoding image... ";
     unsigned w, h;
-    err = lodepng::decode(this->image, w, h, png);
+    err = singleChannel
+        ? this->decodeGray(png, w, h)
+        : lodepng::decode(this->image, w, h, png);
     cout << "Done." << endl;
 
     this->width = w;
     this->height= h;
+    this->hostValid = true;
+    this->deviceValid = false;
 
-
-    // the pixels are now in the vector "image", 4 bytes per pixel, ordered RGBARGBA...
+    // the pixels are now in the vector "image", either 4 bytes per pixel,
+    // ordered RGBARGBA..., or 1 byte per pixel (gray)
 
     if (err) {
         cout << "Decode error " << err << ": " << lodepng_error_text(err) << endl;
@@ -144,6 +195,134 @@ bool Image::load(const std::string &filename)
     return true;
 }
 
+/**
+ * Decodes PNG data directly to a single channel (grayscale) image.
+ * Non-interlaced 8-bit PNGs (gray, gray + alpha, RGB, RGBA) are inflated and
+ * then unfiltered one scanline at a time, and each row is converted to
+ * luminance as soon as it is unfiltered. Only the inflated (filtered)
+ * scanlines, two unfiltered rows and the gray image are stored, instead of
+ * the full decoded image in addition to them. Other formats (palette, 16-bit,
+ * interlaced, ...) are decoded by lodepng and converted in place.
+ * 
+ * @param png PNG file contents.
+ * @param w   Decoded image width is stored here.
+ * @param h   Decoded image height is stored here.
+ * @return    Zero on success, lodepng error code on fail.
+ */
+unsigned Image::decodeGray(const std::vector<unsigned char> &png, unsigned &w, unsigned &h)
+{
+    unsigned err;
+    lodepng::State state;
+
+    err = lodepng_inspect(&w, &h, &state, png.data(), png.size());
+    if (err) return err;
+
+    const LodePNGColorMode &color = state.info_png.color;
+    const size_t pixels = (size_t)w * h;
+
+    if (color.bitdepth == 8 && color.colortype != LCT_PALETTE && state.info_png.interlace_method == 0)
+    {
+        const size_t channels = lodepng_get_channels(&color);
+        const size_t rowBytes = (size_t)w * channels;
+
+        // the compressed data of all the IDAT chunks (after the signature)
+        std::vector<unsigned char> idat;
+        const unsigned char *end = png.data() + png.size();
+
+        for (const unsigned char *chunk = png.data() + 8; chunk + 12 <= end; chunk = lodepng_chunk_next_const(chunk))
+        {
+            if (lodepng_chunk_length(chunk) > (size_t)(end - chunk) - 12) return 30;
+            if (lodepng_chunk_type_equals(chunk, "IEND")) break;
+            if (!lodepng_chunk_type_equals(chunk, "IDAT")) continue;
+            if (lodepng_chunk_check_crc(chunk)) return 57;
+
+            const unsigned char *data = lodepng_chunk_data_const(chunk);
+            idat.insert(idat.end(), data, data + lodepng_chunk_length(chunk));
+        }
+
+        // each scanline is preceded by its filter type
+        std::vector<unsigned char> scanlines;
+        err = lodepng::decompress(scanlines, idat);
+        if (err) return err;
+        if (scanlines.size() < h * (rowBytes + 1)) return 91;
+
+        std::vector<unsigned char>().swap(idat);
+
+        this->image.assign(pixels, 0);
+        std::vector<unsigned char> previous(rowBytes, 0), current(rowBytes);
+
+        for (size_t y = 0; y < h; y++)
+        {
+            const unsigned char *in = &scanlines[y * (rowBytes + 1)];
+            const unsigned char filter = *in++;
+            unsigned char *row = current.data();
+            const unsigned char *up = previous.data();
+
+            // PNG filters (the "left" pixel is channels bytes before)
+            const size_t c = channels;
+            switch (filter)
+            {
+            case 0:
+                std::copy(in, in + rowBytes, row);
+                break;
+            case 1:
+                for (size_t i = 0; i < rowBytes; i++) row[i] = in[i] + (i >= c ? row[i - c] : 0);
+                break;
+            case 2:
+                for (size_t i = 0; i < rowBytes; i++) row[i] = in[i] + up[i];
+                break;
+            case 3:
+                for (size_t i = 0; i < rowBytes; i++) row[i] = in[i] + (((i >= c ? row[i - c] : 0) + up[i]) >> 1);
+                break;
+            case 4:
+                for (size_t i = 0; i < rowBytes; i++)
+                {
+                    const int left = (i >= c) ? row[i - c] : 0;
+                    const int upLeft = (i >= c) ? up[i - c] : 0;
+                    const int pa = std::abs(up[i] - upLeft);
+                    const int pb = std::abs(left - upLeft);
+                    const int pc = std::abs(left + up[i] - 2 * upLeft);
+                    row[i] = in[i] + ((pc < pa && pc < pb) ? upLeft : (pb < pa) ? up[i] : left);
+                }
+                break;
+            default:
+                return 36;
+            }
+
+            unsigned char *gray = &this->image[y * w];
+            for (size_t x = 0; x < w; x++)
+            {
+                const unsigned char *p = row + x * channels;
+                gray[x] = (channels >= 3) ? luminance(p[0], p[1], p[2]) : p[0];
+            }
+
+            previous.swap(current);
+        }
+
+        return 0;
+    }
+
+    // let lodepng convert to RGBA
+    err = lodepng::decode(this->image, w, h, state, png);
+    if (err) return err;
+
+    const size_t channels = lodepng_get_channels(&state.info_raw);
+    unsigned char *data = this->image.data();
+
+    // Each gray pixel is written at or before the position it is read from,
+    // so the conversion can be done in place in a single sequential pass.
+    for (size_t i = 0; i < pixels; i++)
+    {
+        const unsigned char *p = data + i * channels;
+        data[i] = (channels >= 3) ? luminance(p[0], p[1], p[2]) : p[0];
+    }
+
+    this->image.resize(pixels);
+    this->image.shrink_to_fit();
+
+    return 0;
+}
+
 /**
  * Encode PNG and save it to the disk.
  * Returns true on success, false on fail.
@@ -156,6 +335,12 @@ bool Image::save(const std::string &filename)
     unsigned err;
     std::vector<unsigned char> png;
 
+    // the image may have been processed on the device
+    if (!this->toHost()) {
+        cout << "Error reading the image from the device." << endl;
+        return false;
+    }
+
     cout << "Encoding image... ";
     err = lodepng::encode(png, this->image,
         (unsigned)this->width, (unsigned)this->height, singleChannel ? LCT_GREY : LCT_RGBA);
@@ -178,6 +363,153 @@ bool Image::save(const std::string &filename)
     return true;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Host / device synchronization
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Makes sure that the device buffer exists and matches the image size.
+ * The contents of a newly created buffer are undefined.
+ * 
+ * @return True on success, false on fail.
+ */
+bool Image::allocateDevice()
+{
+    if (deviceBuffer && deviceSize == sizeBytes())
+        return true;
+
+    this->releaseDevice();
+
+    if (!ocl) {
+        cout << "Cannot use device memory without instance of MiniOCL." << endl;
+        return false;
+    }
+
+    // On devices sharing the memory with the host (e.g. CPUs), the buffer
+    // uses the host copy directly if possible, so nothing needs to be copied.
+    if (ocl->hasUnifiedMemory())
+    {
+        this->image.resize(sizeBytes());
+        deviceBuffer = ocl->wrapHostMemory(image.data(), sizeBytes());
+        deviceWrapsHost = deviceBuffer != nullptr;
+    }
+
+    if (!deviceBuffer)
+        deviceBuffer = ocl->createBuffer(sizeBytes());
+    deviceSize = deviceBuffer ? sizeBytes() : 0;
+
+    return deviceBuffer != nullptr;
+}
+
+/**
+ * Returns the image as a device buffer to be used as a kernel input.
+ * The image is uploaded only if the device copy is not up to date.
+ * 
+ * @return The device buffer on success, NULL on fail.
+ */
+cl_mem Image::toDevice()
+{
+    if (deviceValid)
+        return deviceBuffer;
+
+    // The copy is not waited for: the kernels using the buffer are enqueued
+    // after it. The host copy must not change until the upload has completed.
+    // A buffer wrapping the host copy is only synchronized (mapped), not copied.
+    if (!this->allocateDevice() || !ocl->enqueueWrite(deviceBuffer, image.data(), sizeBytes(), &upload))
+        return nullptr;
+
+    deviceValid = true;
+    return deviceBuffer;
+}
+
+/**
+ * Returns the device buffer to be used as a kernel output. After this, the
+ * device copy is the up to date one and the host copy is read back lazily.
+ * 
+ * @return The device buffer on success, NULL on fail.
+ */
+cl_mem Image::deviceOutput()
+{
+    if (!this->allocateDevice())
+        return nullptr;
+
+    deviceValid = true;
+    hostValid = false;
+    return deviceBuffer;
+}
+
+/**
+ * Replaces the device copy with a buffer created with MiniOCL::createBuffer()
+ * and takes ownership of it. The width, height and channels must already be
+ * set to match the buffer. The (now stale) host copy is freed.
+ * 
+ * @param buffer Device buffer containing the new image.
+ */
+void Image::adoptDeviceBuffer(cl_mem buffer)
+{
+    this->detachHost();
+    this->releaseDevice();
+
+    deviceBuffer = buffer;
+    deviceSize = sizeBytes();
+    deviceValid = true;
+    hostValid = false;
+
+    std::vector<unsigned char>().swap(this->image);
+}
+
+/**
+ * Makes the host copy of the image up to date, reading it back from the
+ * device if necessary.
+ * 
+ * @return True on success, false on fail.
+ */
+bool Image::toHost()
+{
+    if (hostValid)
+        return true;
+
+    Event done;
+    this->image.resize(sizeBytes());
+
+    // waits for the kernels writing the buffer as well
+    if (!ocl->enqueueRead(deviceBuffer, image.data(), sizeBytes(), &done) || !done.wait())
+        return false;
+
+    hostValid = true;
+    return true;
+}
+
+/**
+ * Releases the device copy of the image.
+ */
+void Image::releaseDevice()
+{
+    if (deviceBuffer)
+        ocl->releaseBuffer(deviceBuffer);
+
+    deviceBuffer = nullptr;
+    deviceSize = 0;
+    deviceValid = false;
+    deviceWrapsHost = false;
+}
+
+/**
+ * Must be called before the host copy (the vector) is replaced or freed.
+ * Waits for a pending upload, and releases a device buffer that uses the
+ * host copy directly once the kernels using it have finished.
+ */
+void Image::detachHost()
+{
+    upload.wait();
+
+    if (deviceWrapsHost)
+    {
+        ocl->finish();
+        this->releaseDevice();
+    }
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // Image manipulation
 ///////////////////////////////////////////////////////////////////////////////
@@ -194,9 +526,12 @@ bool Image::convertToGrayscale()
     bool success = true;
     cout << "Transforming image to grayscale... ";
 
-    Image *tempImage = new Image();
-    tempImage->setSingleChannel(true);
-    tempImage->createEmpty(width, height);
+    // e.g. decoded straight to gray when loaded
+    if (singleChannel)
+    {
+        cout << "Already grayscale." << endl;
+        return true;
+    }
 
 #ifdef USE_OCL /* OpenCL (GPU or CPU) */
 
@@ -205,19 +540,30 @@ bool Image::convertToGrayscale()
         return false;
     }
 
+    // the gray image is left on the device for the next stages
+    cl_mem grayBuffer = ocl->createBuffer(width * height);
+
     // set up OpenCL for execution
 
-    success = ocl->buildKernel("grayscale");
+    success = ocl->useKernel("grayscale") && this->toHost();
 
     ocl->setInputImageBuffer(
         0, static_cast<void *>(image.data()), width, height, false);            // image in
-    ocl->setOutputImageBuffer(
-        1, static_cast<void *>(tempImage->image.data()), width, height, true);  // image out
+    ocl->setBuffer(
+        1, grayBuffer);                                                         // image out
 
-    success = ocl->executeKernel(width, height, 16, 16);
+    success = success && ocl->enqueueKernel(width, height, OCL_LOCAL_AUTO, OCL_LOCAL_AUTO);
+
+    // update the image
+    this->setSingleChannel(true);
+    this->adoptDeviceBuffer(grayBuffer);
 
 #else /* No parallelization */
 
+    Image *tempImage = new Image();
+    tempImage->setSingleChannel(true);
+    tempImage->createEmpty(width, height);
+
     #ifdef USE_OMP
     # pragma omp parallel for
     #endif
@@ -232,11 +578,12 @@ bool Image::convertToGrayscale()
         }
     }
 
-#endif
     // update the image
     this->setSingleChannel(true);
     this->replace(*tempImage, true);
+    delete tempImage;
 
+#endif
     cout << "Done." << endl;
     return success;
 }
@@ -258,6 +605,22 @@ bool Image::filter(const Filter &filter)
         return false;
     }
 
+    // uniform masks (e.g. mean) can be done in constant time per pixel
+    if (filter.uniform)
+    {
+        success = this->filterBox(filter.size, filter.mask[0], filter.divisor);
+        cout << "Done." << endl;
+        return success;
+    }
+
+    // rank-1 masks can be done as two 1D passes
+    if (filter.separable)
+    {
+        success = this->filterSeparable(filter);
+        cout << "Done." << endl;
+        return success;
+    }
+
 #ifdef USE_OCL /* OpenCL (GPU or CPU) */
 
     if (!ocl) {
@@ -265,12 +628,26 @@ bool Image::filter(const Filter &filter)
         return false;
     }
 
-    success = ocl->buildKernel("filter");
+    // Single channel images are handled as plain buffers instead of images
+    // and stay on the device. RGBA images go through the host.
+    cl_mem filteredBuffer = nullptr;
+
+    if (singleChannel)
+    {
+        filteredBuffer = ocl->createBuffer(sizeBytes());
+        success = ocl->useKernel("filter_gray");
+
+        ocl->setBuffer(0, this->toDevice());                                    // image in
+        ocl->setBuffer(1, filteredBuffer);                                      // image out
+    } else {
+        success = ocl->useKernel("filter") && this->toHost();
+
+        ocl->setInputImageBuffer(
+            0, static_cast<void *>(image.data()), width, height, false);        // image in
+        ocl->setOutputImageBuffer(
+            1, static_cast<void *>(image.data()), width, height, false);        // image out
+    }
 
-    ocl->setInputImageBuffer(
-        0, static_cast<void *>(image.data()), width, height, singleChannel);    // image in
-    ocl->setOutputImageBuffer(
-        1, static_cast<void *>(image.data()), width, height, singleChannel);    // image out
     ocl->setInputBuffer(
         2, (void *)filter.mask, filter.size * filter.size * sizeof(float));     // filter mask
     ocl->setValue(
@@ -278,58 +655,24 @@ bool Image::filter(const Filter &filter)
     ocl->setValue(
         4, (void *)&filter.divisor, sizeof(float));                             // filter divisor
 
-    success = ocl->executeKernel(width, height, 16, 16);
-
-#else /* No parallelization */
-
-    // TODO: This implementation could use different edge handling techniques.
-    Image tempImage;
-    tempImage.createEmpty(width, height);
-
-    int d = static_cast<int>(filter.size) / 2; // kernel's "edge thickness"
-
-    #ifdef USE_OMP
-    # pragma omp parallel for
-    #endif
-    for (int cy = 0; cy < (int)height; cy++)
+    if (singleChannel)
     {
-        for (int cx = 0; cx < (int)width; cx++)
-        {
-            unsigned int weight = 0;
-            // we need more space per pixel since we first accumulate and then divide
-            unsigned long int newRed = 0, newGreen = 0, newBlue = 0, newAlpha = 0;
+        ocl->setValue(
+            5, (void *)&width, sizeof(int));                                    // image width
+        ocl->setValue(
+            6, (void *)&height, sizeof(int));                                   // image height
+    }
 
-            // iterate over each element in the mask
-            for (int y = cy - d; y <= (int)(cy + d); y++)
-            {
-                for (int x = cx - d; x <= (int)(cx + d); x++)
-                {
-                    // get pixel if within image
-                    Pixel p = validCoordinates(x, y)
-                        ? this->getPixel(x, y)
-                        : Pixel(0, 0, 0, 0);
-
-                    newRed   += unsigned(filter.mask[weight]) * p.red;
-                    newGreen += unsigned(filter.mask[weight]) * p.green;
-                    newBlue  += unsigned(filter.mask[weight]) * p.blue;
-                    newAlpha  += unsigned(filter.mask[weight]) * p.alpha;
-                    weight++;
-                }
-            }
+    success = success && ocl->executeKernel(width, height, OCL_LOCAL_AUTO, OCL_LOCAL_AUTO);
 
-            Pixel newClr(
-                (unsigned char)(newRed / filter.divisor),
-                (unsigned char)(newGreen / filter.divisor),
-                (unsigned char)(newBlue / filter.divisor),
-                (unsigned char)(newAlpha / filter.divisor));
+    if (singleChannel)
+        this->adoptDeviceBuffer(filteredBuffer);
+    else
+        deviceValid = false;
 
-            // replace the pixel in the center of the mask
-            tempImage.putPixel(cx, cy, newClr);
-        }
-    }
+#else /* No parallelization */
 
-    // update the image
-    this->replace(tempImage);
+    success = this->filterFixedPoint(filter);
 
 #endif
     cout << "Done." << endl;
@@ -337,444 +680,1911 @@ bool Image::filter(const Filter &filter)
 }
 
 /**
- * Dynamically creates an averaging filter and applies it to the image.
+ * Applies a (non-separable) mask to the image on the CPU using fixed-point
+ * arithmetic. The mask is scaled by 2^shift and rounded to 16-bit integers,
+ * so the weights keep their signs, and the result is rounded and saturated
+ * to 0-255. With AVX2, 16 channel values are computed at a time: pixels are
+ * widened to 16-bit lanes and two taps are multiplied and summed into 32-bit
+ * accumulators with a single instruction (madd). Zero weights are skipped.
  * 
- * @param size Size of the mask.
- * @return     True on success, false on fail.
+ * @param filter Filter to be applied to the image.
+ * @return       True on success, false on fail.
  */
-bool Image::filterMean(const size_t size)
+bool Image::filterFixedPoint(const Filter &filter)
 {
-    bool success = false;
-    if (size == 0) return false;
+    const int channels = singleChannel ? 1 : 4;
+    const int size = static_cast<int>(filter.size);
+    const int r = size / 2;  // kernel's "edge thickness"
+
+    // Pick the largest shift (precision) so that each weight fits in int16
+    // and the worst case sum of the 8-bit pixels fits in int32.
+    float maxWeight = 0.0f, sumWeights = 0.0f;
+    for (int i = 0; i < size * size; i++)
+    {
+        const float weight = fabsf(filter.mask[i] / filter.divisor);
+        maxWeight = std::max(maxWeight, weight);
+        sumWeights += weight;
+    }
 
-    // fill the mask with ones
-    float *mask = (float*)malloc( size * size * sizeof(float) );
+    int shift = 14;
+    while (shift > 0 && (maxWeight * (1 << shift) > 32767.0f ||
+                         sumWeights * 255.0f * (1 << shift) > 2147483647.0f))
+        shift--;
 
-    if (mask != NULL)
+    if (maxWeight * (1 << shift) > 32767.0f)
     {
-        // populate the mask with ones
-        for (unsigned int i = 0; i < (size * size); i++) { mask[i] = 1.0f; }
-
-        const Filter filter((const size_t)size, (const float)(size * size), mask);
-        success = this->filter(filter);
+        cout << "Error: mask weights out of range." << endl;
+        return false;
     }
 
-    free(mask);
-    return success;
-}
+    // Copy the image with a zero border of r pixels, so no tap needs
+    // bounds checking. Pixels outside of the image are zero, like before.
+    const int rowLength = (int)width * channels;
+    const int paddedLength = ((int)width + 2 * r) * channels;
+    std::vector<unsigned char> padded(paddedLength * (height + 2 * r), 0);
 
-/**
- * Scales the image down by given integer factor. Current implementation
- * is quite rough: just blur using an averaging filter and then drop
- * some pixels. In this case, however, it works very well.
- *
- * @todo Different factor for x and y would be easy.
- *
- * @param factor Scaling factor.
- * @return       True on success, false on fail.
- */
-bool Image::downScale(unsigned int factor)
-{
-    cout << "Resizing image... ";
+    for (int y = 0; y < (int)height; y++)
+        std::copy(&image[y * rowLength], &image[y * rowLength] + rowLength,
+                  &padded[(y + r) * paddedLength + r * channels]);
 
-    if (factor > 1)
+    // the non-zero taps: offset from the top-left of the window and weight
+    std::vector<int> offsets;
+    std::vector<short> weights;
+    for (int ky = 0; ky < size; ky++)
     {
-        // Since we cannot use even-sized kernels, use the
-        // closest odd-numbered kernel size towards zero.
-        // For example, if factor = 4 or 5 => maskSize = 5.
-        const size_t maskSize = (factor % 2 == 0) ? factor + 1 : factor;
+        for (int kx = 0; kx < size; kx++)
+        {
+            const short weight = (short)lroundf(filter.mask[ky * size + kx] / filter.divisor * (1 << shift));
+            if (weight == 0) continue;
 
-        // filtering the image first gives a better downscaling quality
-        this->filterMean(maskSize);
+            offsets.push_back(ky * paddedLength + kx * channels);
+            weights.push_back(weight);
+        }
+    }
 
-        Image tempImage;
-        tempImage.createEmpty(this->width / factor, this->height / factor);
+    // taps are processed in pairs, pad with a zero weight tap if necessary
+    if (offsets.size() % 2 == 1)
+    {
+        offsets.push_back(offsets.back());
+        weights.push_back(0);
+    }
 
-        #ifdef USE_OMP
-        # pragma omp parallel for
-        #endif
-        for (int y = 0; y < (int)this->height; y++)
+    const int taps = (int)offsets.size();
+    const int rounding = shift > 0 ? 1 << (shift - 1) : 0;
+
+    Image tempImage(singleChannel);
+    tempImage.createEmpty(width, height);
+
+    #ifdef USE_OMP
+    # pragma omp parallel for
+    #endif
+    for (int y = 0; y < (int)height; y++)
+    {
+        const unsigned char *window = &padded[y * paddedLength];
+        unsigned char *out = &tempImage.image[y * rowLength];
+        int i = 0;
+
+#ifdef __AVX2__
+        const __m256i round = _mm256_set1_epi32(rounding);
+
+        for (; i + 16 <= rowLength; i += 16)
         {
-            if (y % factor == 0) continue; // skip every factor'th row
+            __m256i accLo = round, accHi = round;
 
-            for (int x = 0; x < (int)this->width; x++)
+            for (int t = 0; t < taps; t += 2)
             {
-                if (x % factor == 0) continue; // skip every factor'th column
-
-                // copy the pixel
-                tempImage.putPixel(x / factor, y / factor, this->getPixel(x, y));
+                // 16 pixels of both taps widened to 16 bits and interleaved
+                const __m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(window + offsets[t] + i)));
+                const __m256i b = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(window + offsets[t + 1] + i)));
+                const __m256i w = _mm256_set1_epi32((weights[t + 1] << 16) | (unsigned short)weights[t]);
+
+                // a * w0 + b * w1 as 32-bit integers
+                accLo = _mm256_add_epi32(accLo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w));
+                accHi = _mm256_add_epi32(accHi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w));
             }
+
+            accLo = _mm256_srai_epi32(accLo, shift);
+            accHi = _mm256_srai_epi32(accHi, shift);
+
+            // Saturate to 16 and then 8 bits. The packs work within 128-bit
+            // lanes, which undoes the order of the unpacks, so the bytes only
+            // need to be gathered to the low lane.
+            const __m256i words = _mm256_packs_epi32(accLo, accHi);
+            const __m256i bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(words, words), 0x08);
+            _mm_storeu_si128((__m128i *)(out + i), _mm256_castsi256_si128(bytes));
         }
+#endif /* __AVX2__ */
 
-        this->replace(tempImage);
+        // the rest of the row (or all of it without AVX2)
+        for (; i < rowLength; i++)
+        {
+            int acc = rounding;
+
+            for (int t = 0; t < taps; t++)
+                acc += weights[t] * window[offsets[t] + i];
+
+            out[i] = (unsigned char)std::min(255, std::max(0, acc >> shift));
+        }
     }
 
-    cout << "Done." << endl;
+    // update the image
+    this->replace(tempImage);
+
     return true;
 }
 
 /**
- * Calculates the disparity map of the image compared to
- * another image. The disparity map replaces the current image.
+ * Applies a box filter (a mask where every value is @weight) to the image.
+ * The filter is separable, so it is done as a horizontal and a vertical pass
+ * using running sums. The cost per pixel does not depend on the mask size.
+ * 
+ * @param size    Size of the mask.
+ * @param weight  The value of each mask element.
+ * @param divisor The mask is divided by this.
+ * @return        True on success, false on fail.
+ */
+bool Image::filterBox(size_t size, float weight, float divisor)
+{
+    bool success = true;
+    const int channels = singleChannel ? 1 : 4;
+    const int r = static_cast<int>(size) / 2;  // kernel's "edge thickness"
+
+#ifdef USE_OCL /* OpenCL (GPU or CPU) */
+
+    if (!ocl) {
+        cout << "Cannot do parallel execution without instance of MiniOCL." << endl;
+        return false;
+    }
+
+    // 1. horizontal sums of each row to the scratch buffer, in segments of
+    //    the rows so that even a few rows keep the device busy
+    const int segment = 32;
+    const size_t segments = (width + segment - 1) / segment;
+
+    success = ocl->useKernel("box_filter_rows");
+
+    ocl->setBuffer(0, this->toDevice());                                // image in
+    ocl->setScratchBuffer(
+        1, sizeBytes() * sizeof(unsigned int));                         // row sums out
+    ocl->setValue(2, (void *)&width, sizeof(int));                      // image width
+    ocl->setValue(3, (void *)&height, sizeof(int));                     // image height
+    ocl->setValue(4, (void *)&channels, sizeof(int));                   // channels
+    ocl->setValue(5, (void *)&r, sizeof(int));                          // mask radius
+    ocl->setValue(6, (void *)&segment, sizeof(int));                    // row segment length
+
+    success = success && ocl->enqueueKernel(segments * channels, height, OCL_LOCAL_AUTO, OCL_LOCAL_AUTO);
+
+    // 2. vertical sums of the row sums to the image
+    success = success && ocl->useKernel("box_filter_cols");
+
+    ocl->setScratchBuffer(
+        0, sizeBytes() * sizeof(unsigned int));                         // row sums in
+    ocl->setBuffer(1, this->deviceOutput());                            // image out (in place)
+    ocl->setValue(2, (void *)&width, sizeof(int));                      // image width
+    ocl->setValue(3, (void *)&height, sizeof(int));                     // image height
+    ocl->setValue(4, (void *)&channels, sizeof(int));                   // channels
+    ocl->setValue(5, (void *)&r, sizeof(int));                          // mask radius
+    ocl->setValue(6, (void *)&weight, sizeof(float));                   // mask value
+    ocl->setValue(7, (void *)&divisor, sizeof(float));                  // mask divisor
+
+    success = success && ocl->enqueueKernel(width * channels, 1, OCL_LOCAL_AUTO, OCL_LOCAL_AUTO);
+
+#else /* No parallelization */
+
+    // pixels outside of the image are zero, like in filter()
+    const int rowLength = (int)width * channels;
+    std::vector<unsigned int> rowSums(width * height * channels);
+
+    // 1. horizontal pass: running sum over each row and channel
+    #ifdef USE_OMP
+    # pragma omp parallel for
+    #endif
+    for (int y = 0; y < (int)height; y++)
+    {
+        const unsigned char *in = &image[y * rowLength];
+        unsigned int *out = &rowSums[y * rowLength];
+
+        for (int c = 0; c < channels; c++)
+        {
+            unsigned int sum = 0;
+
+            for (int x = 0; x <= r && x < (int)width; x++)
+                sum += in[x * channels + c];
+
+            for (int x = 0; x < (int)width; x++)
+            {
+                out[x * channels + c] = sum;
+
+                if (x + r + 1 < (int)width) sum += in[(x + r + 1) * channels + c];
+                if (x - r >= 0)             sum -= in[(x - r) * channels + c];
+            }
+        }
+    }
+
+    // 2. vertical pass: running sum down strips of columns, a row at a time
+    const int stripLength = 256;
+    const int strips = (rowLength + stripLength - 1) / stripLength;
+
+    #ifdef USE_OMP
+    # pragma omp parallel for
+    #endif
+    for (int strip = 0; strip < strips; strip++)
+    {
+        const int from = strip * stripLength;
+        const int to = std::min(from + stripLength, rowLength);
+        std::vector<unsigned int> colSum(to - from, 0);
+
+        for (int y = 0; y <= r && y < (int)height; y++)
+            for (int i = from; i < to; i++)
+                colSum[i - from] += rowSums[y * rowLength + i];
+
+        for (int y = 0; y < (int)height; y++)
+        {
+            unsigned char *out = &image[y * rowLength];
+
+            for (int i = from; i < to; i++)
+                out[i] = (unsigned char)std::min(255.0f, std::max(0.0f, colSum[i - from] * weight / divisor));
+
+            if (y + r + 1 < (int)height)
+                for (int i = from; i < to; i++)
+                    colSum[i - from] += rowSums[(y + r + 1) * rowLength + i];
+
+            if (y - r >= 0)
+                for (int i = from; i < to; i++)
+                    colSum[i - from] -= rowSums[(y - r) * rowLength + i];
+        }
+    }
+
+#endif
+    return success;
+}
+
+/**
+ * Applies a separable filter to the image as a horizontal pass (rowMask)
+ * followed by a vertical pass (colMask). This takes 2k instead of k^2
+ * operations per pixel for a k x k mask.
+ * 
+ * @param filter Separable filter to be applied to the image.
+ * @return       True on success, false on fail.
+ */
+bool Image::filterSeparable(const Filter &filter)
+{
+    bool success = true;
+    const int channels = singleChannel ? 1 : 4;
+    const int size = static_cast<int>(filter.size);
+
+#ifdef USE_OCL /* OpenCL (GPU or CPU) */
+
+    if (!ocl) {
+        cout << "Cannot do parallel execution without instance of MiniOCL." << endl;
+        return false;
+    }
+
+    // 1. horizontal pass to the scratch buffer
+    success = ocl->useKernel("filter_rows");
+
+    ocl->setBuffer(0, this->toDevice());                                    // image in
+    ocl->setScratchBuffer(
+        1, sizeBytes() * sizeof(float));                                    // rows out
+    ocl->setInputBuffer(
+        2, (void *)filter.rowMask.data(), size * sizeof(float));           // row mask
+    ocl->setValue(3, (void *)&size, sizeof(int));                           // mask size
+    ocl->setValue(4, (void *)&width, sizeof(int));                          // image width
+    ocl->setValue(5, (void *)&height, sizeof(int));                         // image height
+    ocl->setValue(6, (void *)&channels, sizeof(int));                       // channels
+
+    success = success && ocl->enqueueKernel(width, height, OCL_LOCAL_AUTO, OCL_LOCAL_AUTO);
+
+    // 2. vertical pass to the image
+    success = success && ocl->useKernel("filter_cols");
+
+    ocl->setScratchBuffer(
+        0, sizeBytes() * sizeof(float));                                    // rows in
+    ocl->setBuffer(1, this->deviceOutput());                                // image out (in place)
+    ocl->setInputBuffer(
+        2, (void *)filter.colMask.data(), size * sizeof(float));           // column mask
+    ocl->setValue(3, (void *)&size, sizeof(int));                           // mask size
+    ocl->setValue(4, (void *)&width, sizeof(int));                          // image width
+    ocl->setValue(5, (void *)&height, sizeof(int));                         // image height
+    ocl->setValue(6, (void *)&channels, sizeof(int));                       // channels
+    ocl->setValue(7, (void *)&filter.divisor, sizeof(float));               // mask divisor
+
+    success = success && ocl->enqueueKernel(width, height, OCL_LOCAL_AUTO, OCL_LOCAL_AUTO);
+
+#else /* No parallelization */
+
+    // The image is processed in bands of rows. Each band first filters its
+    // rows (and the halo rows above and below) horizontally into a row
+    // buffer, which is then filtered vertically into the output band.
+    // Pixels outside of the image are zero, like in filter().
+    const int r = size / 2;  // kernel's "edge thickness"
+    const int rowLength = (int)width * channels;
+    const int bandHeight = 32;
+    const int bands = ((int)height + bandHeight - 1) / bandHeight;
+    Image tempImage(singleChannel);
+    tempImage.createEmpty(width, height);
+
+    #ifdef USE_OMP
+    # pragma omp parallel for
+    #endif
+    for (int band = 0; band < bands; band++)
+    {
+        const int fromY = band * bandHeight;
+        const int toY = std::min(fromY + bandHeight, (int)height);
+        std::vector<float> rows((toY - fromY + 2 * r) * rowLength, 0.0f);
+
+        // horizontal pass; rows outside of the image stay zero
+        for (int y = std::max(fromY - r, 0); y < std::min(toY + r, (int)height); y++)
+        {
+            const unsigned char *in = &image[y * rowLength];
+            float *out = &rows[(y - fromY + r) * rowLength];
+
+            for (int x = 0; x < (int)width; x++)
+            {
+                for (int k = std::max(-r, -x); k <= std::min(r, (int)width - 1 - x); k++)
+                {
+                    const float weight = filter.rowMask[k + r];
+
+                    for (int c = 0; c < channels; c++)
+                        out[x * channels + c] += weight * in[(x + k) * channels + c];
+                }
+            }
+        }
+
+        // vertical pass
+        for (int y = fromY; y < toY; y++)
+        {
+            unsigned char *out = &tempImage.image[y * rowLength];
+
+            for (int i = 0; i < rowLength; i++)
+            {
+                float sum = 0.0f;
+
+                for (int k = 0; k < size; k++)
+                    sum += filter.colMask[k] * rows[(y - fromY + k) * rowLength + i];
+
+                out[i] = (unsigned char)std::min(255.0f, std::max(0.0f, sum / filter.divisor));
+            }
+        }
+    }
+
+    // update the image
+    this->replace(tempImage);
+
+#endif
+    return success;
+}
+
+/**
+ * Dynamically creates an averaging filter and applies it to the image.
+ * 
+ * @param size Size of the mask.
+ * @return     True on success, false on fail.
+ */
+bool Image::filterMean(const size_t size)
+{
+    bool success = false;
+    if (size == 0) return false;
+
+    // fill the mask with ones
+    float *mask = (float*)malloc( size * size * sizeof(float) );
+
+    if (mask != NULL)
+    {
+        // populate the mask with ones
+        for (unsigned int i = 0; i < (size * size); i++) { mask[i] = 1.0f; }
+
+        const Filter filter((const size_t)size, (const float)(size * size), mask);
+        success = this->filter(filter);
+    }
+
+    free(mask);
+    return success;
+}
+
+/**
+ * Scales the image down by given integer factor. Each output pixel is the
+ * average of a factor x factor block (area averaging), rounded to nearest,
+ * so the host and the OpenCL versions give the same image. With OpenCL, this
+ * is a single launch and the result is left on the device.
+ *
+ * @todo Different factor for x and y would be easy.
+ *
+ * @param factor Scaling factor.
+ * @return       True on success, false on fail.
+ */
+bool Image::downScale(unsigned int factor)
+{
+    cout << "Resizing image... ";
+
+#ifdef USE_OCL /* OpenCL (GPU or CPU) */
+
+    if (factor > 1)
+    {
+        bool success;
+
+        if (!ocl) {
+            cout << "Cannot do parallel execution without instance of MiniOCL." << endl;
+            return false;
+        }
+
+        const size_t outWidth = this->width / factor;
+        const size_t outHeight = this->height / factor;
+        const int channels = singleChannel ? 1 : 4;
+
+        // only the smaller image is kept, on the device
+        cl_mem scaledBuffer = ocl->createBuffer(outWidth * outHeight * channels);
+
+        success = ocl->useKernel("downscale");
+
+        ocl->setBuffer(
+            0, this->toDevice());                                                   // image in
+        ocl->setBuffer(
+            1, scaledBuffer);                                                       // image out
+        ocl->setValue(
+            2, (void *)&width, sizeof(int));                                        // image width
+        ocl->setValue(
+            3, (void *)&height, sizeof(int));                                       // image height
+        ocl->setValue(
+            4, (void *)&channels, sizeof(int));                                     // channels
+        ocl->setValue(
+            5, (void *)&factor, sizeof(int));                                       // scaling factor
+
+        success = success && ocl->enqueueKernel(outWidth, outHeight, OCL_LOCAL_AUTO, OCL_LOCAL_AUTO);
+
+        // update the image
+        this->width = outWidth;
+        this->height = outHeight;
+        this->adoptDeviceBuffer(scaledBuffer);
+
+        if (!success)
+            return false;
+    }
+
+#else /* No parallelization */
+
+    if (factor > 1)
+    {
+        Image tempImage(singleChannel);
+        tempImage.createEmpty(this->width / factor, this->height / factor);
+
+        // leftover rows and columns that don't fill a whole block are dropped
+        const int channels = singleChannel ? 1 : 4;
+        const int rowLength = (int)tempImage.width * factor * channels;
+        const unsigned int scale = factor * factor;
+
+        #ifdef USE_OMP
+        # pragma omp parallel for
+        #endif
+        for (int oy = 0; oy < (int)tempImage.height; oy++)
+        {
+            // column sums (of each channel) over the rows of this block row
+            std::vector<unsigned int> colSum(rowLength, 0);
+            unsigned int *sum = colSum.data();
+
+            for (unsigned int y = oy * factor; y < (oy + 1) * factor; y++)
+            {
+                const unsigned char *row = &image[channels * y * width];
+
+                for (int i = 0; i < rowLength; i++)
+                    sum[i] += row[i];
+            }
+
+            // sum the columns of each block and round to nearest, like the
+            // downscale kernel
+            unsigned char *out = &tempImage.image[oy * tempImage.width * channels];
+
+            for (int ox = 0; ox < (int)tempImage.width; ox++)
+            {
+                for (int c = 0; c < channels; c++)
+                {
+                    unsigned int blockSum = 0;
+
+                    for (unsigned int i = 0; i < factor; i++)
+                        blockSum += sum[(ox * factor + i) * channels + c];
+
+                    out[ox * channels + c] = (unsigned char)((blockSum + scale / 2) / scale);
+                }
+            }
+        }
+
+        this->replace(tempImage);
+    }
+
+#endif
+
+    cout << "Done." << endl;
+    return true;
+}
+
+/**
+ * Scales the image down by given integer factor and converts it to grayscale
+ * in a single pass. Each output pixel is the average luminance of a
+ * factor x factor block, so every source pixel is read exactly once and only
+ * the output pixels are computed. Works for both RGBA and grayscale images.
+ * On the host with AVX2, the luminances of 8 pixels are added to the column
+ * sums at a time: the even (R, B) and odd (G, A) bytes are split to 16-bit
+ * values and weighted with two multiply-adds.
+ *
+ * @param factor Scaling factor (1-128).
+ * @return       True on success, false on fail.
+ */
+bool Image::downScaleToGray(unsigned int factor)
+{
+    bool success = true;
+
+    if (factor == 0 || factor > 128)
+    {
+        cout << "Error: invalid scaling factor." << endl;
+        return false;
+    }
+
+    if (factor == 1)
+        return this->convertToGrayscale();
+
+    cout << "Resizing image to grayscale... ";
+
+    const size_t outWidth = this->width / factor;
+    const size_t outHeight = this->height / factor;
+
+    // NTSC weights in 10-bit fixed point (306 + 601 + 117 = 1024), which keeps
+    // the block sums within 32 bits up to factor 128
+    const int channels = singleChannel ? 1 : 4;
+
+#ifdef USE_OCL /* OpenCL (GPU or CPU) */
+
+    if (!ocl) {
+        cout << "Cannot do parallel execution without instance of MiniOCL." << endl;
+        return false;
+    }
+
+    // the downscaled image is left on the device for the next stages
+    cl_mem grayBuffer = ocl->createBuffer(outWidth * outHeight);
+
+    success = ocl->useKernel("downscale_gray");
+
+    ocl->setBuffer(
+        0, this->toDevice());                                                       // image in (RGBA / gray)
+    ocl->setBuffer(
+        1, grayBuffer);                                                             // image out (gray)
+    ocl->setValue(
+        2, (void *)&width, sizeof(int));                                            // image width
+    ocl->setValue(
+        3, (void *)&height, sizeof(int));                                           // image height
+    ocl->setValue(
+        4, (void *)&channels, sizeof(int));                                         // channels in
+    ocl->setValue(
+        5, (void *)&factor, sizeof(int));                                           // scaling factor
+
+    success = success && ocl->enqueueKernel(outWidth, outHeight, OCL_LOCAL_AUTO, OCL_LOCAL_AUTO);
+
+    // update the image
+    this->width = outWidth;
+    this->height = outHeight;
+    this->setSingleChannel(true);
+    this->adoptDeviceBuffer(grayBuffer);
+
+#else /* No parallelization */
+
+    GrayImage tempImage;
+    tempImage.createEmpty(outWidth, outHeight);
+
+    const int rowLength = (int)outWidth * factor;  // leftover columns are dropped
+    const unsigned int scale = (singleChannel ? 1 : 1024) * factor * factor;
+
+    #ifdef USE_OMP
+    # pragma omp parallel for
+    #endif
+    for (int oy = 0; oy < (int)tempImage.height; oy++)
+    {
+        // column sums over the rows of this block row
+        std::vector<unsigned int> colSum(rowLength, 0);
+        unsigned int *sum = colSum.data();
+
+        for (unsigned int y = oy * factor; y < (oy + 1) * factor; y++)
+        {
+            const unsigned char *row = &image[channels * y * width];
+            int x = 0;
+
+#ifdef __AVX2__
+            if (singleChannel)
+            {
+                // 8 pixels widened to 32 bits at a time
+                for (; x + 8 <= rowLength; x += 8)
+                {
+                    const __m256i pixels = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(row + x)));
+                    __m256i *acc = (__m256i *)(sum + x);
+                    _mm256_storeu_si256(acc, _mm256_add_epi32(_mm256_loadu_si256(acc), pixels));
+                }
+            } else {
+                // R and B (even bytes) and G and A (odd bytes) of 8 RGBA pixels
+                // as 16-bit values, so that each madd gives one 32-bit term per pixel
+                const __m256i evenMask = _mm256_set1_epi32(0x00FF00FF);
+                const __m256i weightsRB = _mm256_set1_epi32((117 << 16) | 306);
+                const __m256i weightsGA = _mm256_set1_epi32(601);
+
+                for (; x + 8 <= rowLength; x += 8)
+                {
+                    const __m256i pixels = _mm256_loadu_si256((const __m256i *)(row + 4 * x));
+                    const __m256i rb = _mm256_and_si256(pixels, evenMask);
+                    const __m256i ga = _mm256_srli_epi16(pixels, 8);
+
+                    // 306 * R + 117 * B + 601 * G (+ 0 * A)
+                    const __m256i luma = _mm256_add_epi32(_mm256_madd_epi16(rb, weightsRB),
+                                                          _mm256_madd_epi16(ga, weightsGA));
+                    __m256i *acc = (__m256i *)(sum + x);
+                    _mm256_storeu_si256(acc, _mm256_add_epi32(_mm256_loadu_si256(acc), luma));
+                }
+            }
+#endif /* __AVX2__ */
+
+            // the rest of the row (or all of it without AVX2)
+            if (singleChannel)
+            {
+                for (; x < rowLength; x++)
+                    sum[x] += row[x];
+            } else {
+                for (; x < rowLength; x++)
+                    sum[x] += 306u * row[4*x] + 601u * row[4*x + 1] + 117u * row[4*x + 2];
+            }
+        }
+
+        // sum the columns of each block and round to nearest
+        unsigned char *out = &tempImage.image[oy * outWidth];
+
+        for (int ox = 0; ox < (int)outWidth; ox++)
+        {
+            unsigned int blockSum = 0;
+
+            for (unsigned int i = 0; i < factor; i++)
+                blockSum += sum[ox * factor + i];
+
+            out[ox] = (unsigned char)((blockSum + scale / 2) / scale);
+        }
+    }
+
+    // update the image
+    this->setSingleChannel(true);
+    this->replace(tempImage, true);
+
+#endif
+    cout << "Done." << endl;
+    return success;
+}
+
+/**
+ * Calculates the disparity map of the image compared to
+ * another image. The disparity map replaces the current image.
+ * 
+ * @param otherImg     The image to be compared against.
+ * @param disparityMap Pointer to a location to store the disparity map.
+ * @param windowSize   Traverse the right image to right instead of left.
+ * @param maxSearchD   Traverse the right image to right instead of left.
+ * @param reverse      Traverse the right image to right instead of left.
+ * @return             True on success, false on fail.
+ */
+bool Image::calcZNCC(Image &otherImg, Image *disparityMap, unsigned int windowSize, unsigned int maxSearchD, bool reverse /* = false */)
+{
+    /**
+     * This method has three different calculation methods:
+     * 1. Sequential (normal CPU execution).
+     * 2. Parallel on CPU, using Pthread.
+     * 3. Parallel on GPU or CPU, using OpenCL.
+     */
+    disparityMap->createEmpty(otherImg.width, otherImg.height);
+
+    if (windowSize % 2 == 0)
+    {
+        cout << "Window size must be odd." << endl;
+        return false;
+    }
+
+    const char halfWindow = (windowSize - 1) / 2;
+    char dir = reverse ? 1 : -1;  // d = -1 -> move left (default), d = +1 -> move right
+
+#ifndef USE_THREADS
+    // arguments for calculating the whole picture in one thread
+    ZNCCArgs *args = new ZNCCArgs(0, windowSize, halfWindow, (unsigned int)this->height - halfWindow - 1, dir, maxSearchD, this, &otherImg, disparityMap);
+#endif
+
+#ifdef USE_OCL /* OpenCL (GPU or CPU) */
+
+    bool success;
+
+    if (!ocl) {
+        cout << "Cannot do parallel execution without instance of MiniOCL." << endl;
+        return false;
+    }
+
+    // The disparity map is left on the device. The kernel does not write
+    // the edges, so the map is cleared there instead of uploading zeros.
+    if (!disparityMap->ocl)
+        disparityMap->setOpenCL(ocl);
+
+    cl_mem disparityBuffer = disparityMap->deviceOutput();
+
+    // local memory needed by the tiled kernel (see calc_zncc_tiled)
+    const size_t tile = 16;
+    const size_t leftTileBytes = (tile + 2 * halfWindow) * (tile + 2 * halfWindow);
+    const size_t rightTileBytes = (tile + 2 * halfWindow + maxSearchD) * (tile + 2 * halfWindow);
+    const size_t sumBytes = (tile + maxSearchD) * tile * sizeof(cl_int);
+    const size_t varBytes = (tile + maxSearchD) * tile * sizeof(cl_long);
+
+    // a variant with the parameters as compile-time constants
+    std::string options;
+#if OCL_SPECIALIZE_KERNELS
+    options = "-DWINDOW_SIZE=" + std::to_string(windowSize) +
+              " -DSEARCH_DIR=" + std::to_string((int)dir) +
+              " -DMAX_SEARCH_D=" + std::to_string(maxSearchD);
+#endif
+
+    // The tiled kernel needs tile x tile work-groups, which the kernel must
+    // support on the device as well; otherwise calc_zncc is used.
+    const bool tiled = ZNCC_KERNEL == ZNCC_TILED &&
+        leftTileBytes + rightTileBytes + sumBytes + varBytes <= ocl->getLocalMemSize() &&
+        ocl->useKernel("calc_zncc_tiled", options) && ocl->supportsLocalSize(tile, tile);
+
+    const char *kernelName = tiled ? "calc_zncc_tiled"
+                           : (ZNCC_KERNEL == ZNCC_VEC) ? "calc_zncc_vec" : "calc_zncc";
+
+    success = ocl->useKernel(kernelName, options) && disparityBuffer &&
+              ocl->fillBuffer(disparityBuffer, 0, disparityMap->sizeBytes());
+
+    ocl->setBuffer(
+        0, this->toDevice());                                                               // this image in
+    ocl->setBuffer(
+        1, otherImg.toDevice());                                                            // other image in
+    ocl->setBuffer(
+        2, disparityBuffer);                                                                // image out (disparity map)
+    ocl->setValue(
+        3, (void*)&width, sizeof(int));                                                     // image width
+    ocl->setValue(
+        4, (void*)&height, sizeof(int));                                                    // image height
+    ocl->setValue(
+        5, (void *)&args->windowSize, sizeof(const char));                                  // window size
+    ocl->setValue(
+        6, (void *)&args->dir, sizeof(char));                                               // direction
+    ocl->setValue(
+        7, (void *)&args->maxSearchD, sizeof(unsigned int));                                // max search distance
+
+    if (tiled)
+    {
+        ocl->setLocalBuffer(8, leftTileBytes);                                              // left tile
+        ocl->setLocalBuffer(9, rightTileBytes);                                             // right strip
+        ocl->setLocalBuffer(10, sumBytes);                                                  // right window sums
+        ocl->setLocalBuffer(11, varBytes);                                                  // right window variances
+    }
+
+    // the local buffers of the tiled kernel are sized for tile x tile groups
+    const size_t localSize = tiled ? tile : OCL_LOCAL_AUTO;
+
+    success = success && ocl->enqueueKernel(width, height, localSize, localSize);
+
+    if (!success)
+        return false;
+
+#else /* Use Pthread or no parallelization. */
+# ifdef USE_THREADS /* Use Pthread */
+
+    pthread_t threads[NUM_THREADS];     // holds the thread handles
+    ZNCCArgs *args[NUM_THREADS];        // holds the thread arguments
+
+    // For example, 8 threads.
+    // We will divide the image to NUM_THREADS equal horizontal strips.
+    // Each strip is a working area of one thread.
+    // The height of each strip must be LARGER THAN OR EQUAL TO the window size.
+    if (this->height <= NUM_THREADS * windowSize)
+    {
+        cout << "Error! Too small picture for " << NUM_THREADS << " threads!" << endl;
+        return false; // TODO: free args still...
+    }
+
+    unsigned int rowsPerThread = this->height / NUM_THREADS; // 504 / 8 = 63
+    unsigned int fromY = halfWindow;
+    unsigned int toY = rowsPerThread - 1;
+
+    for (int i = 0; i < NUM_THREADS; i++)
+    {
+        // threadId, windowSize, dir, maxSearchD, fromY, toY, thisImg, otherImg, disparityMap
+        args[i] = new ZNCCArgs(i, windowSize, fromY, toY, dir, maxSearchD, this, &otherImg, disparityMap);
+        int err = pthread_create(&threads[i], NULL, calculateZNCC_thread_proxy, (void *)args[i]);
+        if (err) {
+            cout << "Error! Unable to create thread: " << err << endl;
+            break;
+        }
+        //cout << "\tThread " << i << " created." << endl;
+
+        fromY = toY + 1;
+        toY = fromY + rowsPerThread - 1;
+
+        // if next is the last thread (lowest part)
+        if (i == (NUM_THREADS - 2))
+            toY -= halfWindow;
+    }
+
+    // Wait for threads to finish; after finish, delete its argument struct.
+    for (int i = 0; i < NUM_THREADS; i++)
+    {
+        pthread_join(threads[i], NULL);
+        //cout << "\tThread " << i << " done." << endl;
+        delete args[i];
+    }
+
+# else /* No parallelization */
+
+    // Execute in a single "thread" using the same
+    // proxy as the Pthread implementation.
+    calculateZNCC_thread_proxy(args);
+
+# endif
+#endif
+
+#ifndef USE_THREADS
+    delete args;
+#endif
+
+    cout << "Calculating ZNCC... Done.\r" << endl;
+    return true;
+}
+
+/**
+ * Calculates the disparity maps of both directions, the image being the left
+ * one. With ZNCC_PAIR, both maps are calculated by a single kernel launch
+ * (calc_zncc_lr); otherwise this is the same as calling calcZNCC() twice.
+ * 
+ * @param rightImg       The right image.
+ * @param leftDisparity  Pointer to a location to store the left-to-right disparity map.
+ * @param rightDisparity Pointer to a location to store the right-to-left disparity map.
+ * @param windowSize     Size of the ZNCC window (odd).
+ * @param maxSearchD     Maximum disparity to search.
+ * @return               True on success, false on fail.
+ */
+bool Image::calcZNCCPair(Image &rightImg, Image *leftDisparity, Image *rightDisparity, unsigned int windowSize, unsigned int maxSearchD)
+{
+#if defined(USE_OCL) && ZNCC_KERNEL == ZNCC_PAIR
+
+    bool success;
+
+    if (!ocl) {
+        cout << "Cannot do parallel execution without instance of MiniOCL." << endl;
+        return false;
+    }
+
+    if (windowSize % 2 == 0)
+    {
+        cout << "Window size must be odd." << endl;
+        return false;
+    }
+
+    cout << "Calculating ZNCC (both directions)... ";
+
+    leftDisparity->createEmpty(width, height);
+    rightDisparity->createEmpty(width, height);
+
+    // Both maps are left on the device. The kernel does not write the edges,
+    // so the maps are cleared there instead of uploading zeros.
+    if (!leftDisparity->ocl)
+        leftDisparity->setOpenCL(ocl);
+    if (!rightDisparity->ocl)
+        rightDisparity->setOpenCL(ocl);
+
+    cl_mem leftBuffer = leftDisparity->deviceOutput();
+    cl_mem rightBuffer = rightDisparity->deviceOutput();
+
+    // a variant with the parameters as compile-time constants
+    std::string options;
+#if OCL_SPECIALIZE_KERNELS
+    options = "-DWINDOW_SIZE=" + std::to_string(windowSize) +
+              " -DMAX_SEARCH_D=" + std::to_string(maxSearchD);
+#endif
+
+    success = ocl->useKernel("calc_zncc_lr", options) && leftBuffer && rightBuffer &&
+              ocl->fillBuffer(leftBuffer, 0, leftDisparity->sizeBytes()) &&
+              ocl->fillBuffer(rightBuffer, 0, rightDisparity->sizeBytes());
+
+    const char window = (char)windowSize;
+
+    ocl->setBuffer(
+        0, this->toDevice());                                                   // left image in
+    ocl->setBuffer(
+        1, rightImg.toDevice());                                                // right image in
+    ocl->setBuffer(
+        2, leftBuffer);                                                         // left disparity map out
+    ocl->setBuffer(
+        3, rightBuffer);                                                        // right disparity map out
+    ocl->setValue(
+        4, (void*)&width, sizeof(int));                                         // image width
+    ocl->setValue(
+        5, (void*)&height, sizeof(int));                                        // image height
+    ocl->setValue(
+        6, (void *)&window, sizeof(char));                                      // window size
+    ocl->setValue(
+        7, (void *)&maxSearchD, sizeof(unsigned int));                          // max search distance
+
+    success = success && ocl->enqueueKernel(width, height, OCL_LOCAL_AUTO, OCL_LOCAL_AUTO);
+
+    cout << "Done." << endl;
+    return success;
+
+#else /* Separate kernel launches or host execution */
+
+    return this->calcZNCC(rightImg, leftDisparity, windowSize, maxSearchD) &&
+           rightImg.calcZNCC(*this, rightDisparity, windowSize, maxSearchD, true);
+
+#endif
+}
+
+/**
+ * Calculates the cross-checked disparity map directly, the image being the
+ * left one. The disparities of both directions are calculated for each pixel
+ * and compared right away (see crossCheck()), so the two disparity maps are
+ * never stored and the separate cross-checking pass is not needed. With
+ * OpenCL, this is a single launch of calc_zncc_cross. On the host, the rows
+ * are independent of each other and calculated in parallel with OpenMP; with
+ * Pthread, the maps are calculated in strips and cross-checked as usual.
+ * 
+ * @param rightImg     The right image.
+ * @param disparityMap Pointer to a location to store the cross-checked disparity map.
+ * @param windowSize   Size of the ZNCC window (odd).
+ * @param maxSearchD   Maximum disparity to search.
+ * @param threshold    Cross-checking threshold. Default is 8.
+ * @return             True on success, false on fail.
+ */
+bool Image::calcZNCCCrossChecked(Image &rightImg, Image *disparityMap, unsigned int windowSize, unsigned int maxSearchD,
+                                 int threshold /* = 8 */)
+{
+    if (windowSize % 2 == 0)
+    {
+        cout << "Window size must be odd." << endl;
+        return false;
+    }
+
+    // the images must be exactly the same size
+    if (width != rightImg.width || height != rightImg.height)
+        return false;
+
+#ifdef USE_THREADS /* Use Pthread */
+
+    GrayImage leftDisparity;
+    GrayImage rightDisparity;
+
+    return this->calcZNCCPair(rightImg, &leftDisparity, &rightDisparity, windowSize, maxSearchD) &&
+           disparityMap->crossCheck(leftDisparity, rightDisparity, threshold);
+
+#else
+
+    bool success;
+    cout << "Calculating ZNCC (cross-checked)... ";
+
+    disparityMap->createEmpty(width, height);
+
+# ifdef USE_OCL /* OpenCL (GPU or CPU) */
+
+    if (!ocl) {
+        cout << "Cannot do parallel execution without instance of MiniOCL." << endl;
+        return false;
+    }
+
+    // The map is left on the device. The kernel does not write the edges,
+    // so the map is cleared there instead of uploading zeros.
+    if (!disparityMap->ocl)
+        disparityMap->setOpenCL(ocl);
+
+    cl_mem disparityBuffer = disparityMap->deviceOutput();
+
+    // a variant with the parameters as compile-time constants
+    std::string options;
+#if OCL_SPECIALIZE_KERNELS
+    options = "-DWINDOW_SIZE=" + std::to_string(windowSize) +
+              " -DMAX_SEARCH_D=" + std::to_string(maxSearchD);
+#endif
+
+    success = ocl->useKernel("calc_zncc_cross", options) && disparityBuffer &&
+              ocl->fillBuffer(disparityBuffer, 0, disparityMap->sizeBytes());
+
+    const char window = (char)windowSize;
+
+    ocl->setBuffer(
+        0, this->toDevice());                                                   // left image in
+    ocl->setBuffer(
+        1, rightImg.toDevice());                                                // right image in
+    ocl->setBuffer(
+        2, disparityBuffer);                                                    // cross-checked map out
+    ocl->setValue(
+        3, (void*)&width, sizeof(int));                                         // image width
+    ocl->setValue(
+        4, (void*)&height, sizeof(int));                                        // image height
+    ocl->setValue(
+        5, (void *)&window, sizeof(char));                                      // window size
+    ocl->setValue(
+        6, (void *)&maxSearchD, sizeof(unsigned int));                          // max search distance
+    ocl->setValue(
+        7, (void *)&threshold, sizeof(unsigned int));                           // threshold
+
+    success = success && ocl->enqueueKernel(width, height, OCL_LOCAL_AUTO, OCL_LOCAL_AUTO);
+
+# else /* OpenMP or no parallelization */
+
+    const int halfWindow = (windowSize - 1) / 2;
+
+    #ifdef USE_OMP
+    # pragma omp parallel for
+    #endif
+    for (int y = halfWindow; y < (int)this->height - halfWindow; y++)
+    {
+        for (int x = halfWindow; x < (int)this->width - halfWindow; x++)
+        {
+            unsigned char leftD = this->znccDisparity(rightImg, x, y, (char)windowSize, -1, maxSearchD);
+            unsigned char rightD = rightImg.znccDisparity(*this, x, y, (char)windowSize, 1, maxSearchD);
+
+            // the left one is kept if the directions agree
+            disparityMap->putPixel(x, y, (unsigned char)((std::abs(leftD - rightD) > threshold) ? 0 : leftD));
+        }
+    }
+
+    success = true;
+
+# endif
+
+    cout << "Done." << endl;
+    return success;
+
+#endif
+}
+
+/**
+ * Same as calcZNCC(), but the rows are split across all the devices of
+ * @multi in proportion to their measured throughput. Each device gets a band
+ * of both images (with the window halo above and below), and the disparity
+ * bands are stitched together on the host. The whole times of the devices,
+ * from the upload of the band to the end of its read-back, are used to
+ * update their throughput for the next call.
  * 
  * @param otherImg     The image to be compared against.
  * @param disparityMap Pointer to a location to store the disparity map.
- * @param windowSize   Traverse the right image to right instead of left.
- * @param maxSearchD   Traverse the right image to right instead of left.
+ * @param windowSize   Size of the ZNCC window (odd).
+ * @param maxSearchD   Maximum disparity to search.
+ * @param multi        The devices to be used.
  * @param reverse      Traverse the right image to right instead of left.
  * @return             True on success, false on fail.
  */
-bool Image::calcZNCC(Image &otherImg, Image *disparityMap, unsigned int windowSize, unsigned int maxSearchD, bool reverse /* = false */)
+bool Image::calcZNCCMulti(Image &otherImg, Image *disparityMap, unsigned int windowSize, unsigned int maxSearchD,
+                          MultiOCL &multi, bool reverse /* = false */)
+{
+#ifdef USE_OCL
+
+    const size_t devices = multi.devices.size();
+
+    if (devices == 0) {
+        cout << "Cannot do multi-device execution without OpenCL devices." << endl;
+        return false;
+    }
+
+    if (windowSize % 2 == 0)
+    {
+        cout << "Window size must be odd." << endl;
+        return false;
+    }
+
+    // the bands are cut from the host copies
+    if (!this->toHost() || !otherImg.toHost())
+        return false;
+
+    const size_t halfWindow = (windowSize - 1) / 2;
+    const std::vector<size_t> starts = multi.splitRows(height);
+    const size_t rowBytes = width * (singleChannel ? 1 : 4);
+
+    std::vector<std::unique_ptr<Image>> bands, otherBands, disparityBands;
+    std::vector<size_t> bandStarts;
+    std::vector<Event> readBacks(devices);
+    bool success = true;
+
+    // Enqueue all the bands first, so that the devices run concurrently.
+    for (size_t i = 0; i < devices; i++)
+    {
+        // band rows including the halo (the kernel skips the halo rows)
+        const size_t from = starts[i] > halfWindow ? starts[i] - halfWindow : 0;
+        const size_t to = std::min(starts[i + 1] + halfWindow, height);
+
+        bands.emplace_back(new Image(singleChannel));
+        otherBands.emplace_back(new Image(singleChannel));
+        disparityBands.emplace_back(new GrayImage());
+        bandStarts.push_back(from);
+
+        if (starts[i + 1] == starts[i])
+            continue;
+
+        Image *band = bands.back().get();
+        Image *otherBand = otherBands.back().get();
+
+        band->setOpenCL(multi.devices[i]);
+        otherBand->setOpenCL(multi.devices[i]);
+        disparityBands.back()->setOpenCL(multi.devices[i]);
+
+        band->createEmpty(width, to - from);
+        otherBand->createEmpty(width, to - from);
+        memcpy(band->image.data(), &image[from * rowBytes], (to - from) * rowBytes);
+        memcpy(otherBand->image.data(), &otherImg.image[from * rowBytes], (to - from) * rowBytes);
+
+        success = success && band->calcZNCC(*otherBand, disparityBands.back().get(), windowSize, maxSearchD, reverse);
+
+        // The read-back is enqueued right away, so that each device finishes
+        // on its own and its whole time can be measured from its events.
+        Image *disparityBand = disparityBands.back().get();
+        disparityBand->image.resize(disparityBand->sizeBytes());
+        success = success && multi.devices[i]->enqueueRead(disparityBand->deviceBuffer, disparityBand->image.data(),
+                                                           disparityBand->sizeBytes(), &readBacks[i]);
+        disparityBand->hostValid = true;    // once readBacks[i] has completed
+    }
+
+    disparityMap->createEmpty(otherImg.width, otherImg.height);
+
+    // Stitch the rows each device is responsible for, without the halo.
+    for (size_t i = 0; i < devices && success; i++)
+    {
+        if (starts[i + 1] == starts[i])
+            continue;
+
+        Image *disparityBand = disparityBands[i].get();
+        success = readBacks[i].wait();
+
+        const size_t offset = starts[i] - bandStarts[i];
+        memcpy(&disparityMap->image[starts[i] * width], &disparityBand->image[offset * width],
+               (starts[i + 1] - starts[i]) * width);
+
+        // The time of the device from queueing the upload of its band to the
+        // end of the read-back, i.e. including the transfers. Both are
+        // measured with the clock of the device.
+        cl_ulong queued = 0, end = 0;
+        clGetEventProfilingInfo(bands[i]->upload.get(), CL_PROFILING_COMMAND_QUEUED, sizeof(queued), &queued, NULL);
+        clGetEventProfilingInfo(readBacks[i].get(), CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL);
+
+        const double time = (queued > 0 && end > queued)
+            ? (end - queued) / 1000.0
+            : multi.devices[i]->getExecutionTime();
+
+        multi.updateThroughput(i, starts[i + 1] - starts[i], time);
+    }
+
+    return success;
+
+#else /* No OpenCL devices */
+
+    (void)multi;
+    return this->calcZNCC(otherImg, disparityMap, windowSize, maxSearchD, reverse);
+
+#endif
+}
+
+/**
+ * Returns the disparity with the best ZNCC at (x, y) between the image and
+ * @otherImg (the host version of zncc_disparity in kernels.cl). (x, y) must
+ * be at least half a window away from the edges.
+ * 
+ * @param otherImg   The image to be compared against.
+ * @param x          X coordinate of the pixel.
+ * @param y          Y coordinate of the pixel.
+ * @param windowSize Size of the ZNCC window (odd).
+ * @param dir        Search direction in @otherImg, -1 (left) or 1 (right).
+ * @param maxSearchD Maximum disparity to search.
+ * @return           The disparity.
+ */
+unsigned char Image::znccDisparity(Image &otherImg, int x, int y, char windowSize, char dir, unsigned int maxSearchD)
+{
+    const char halfWindow = (windowSize - 1) / 2;
+
+    unsigned int leftAvg = this->grayAverage(
+        x - halfWindow,
+        y - halfWindow,
+        windowSize,
+        windowSize);
+
+    unsigned char bestD = 0;        // tracks the distance with best correlation
+    float maxCorrelation = 0.0f;    // tracks the best correlation (ZNCC)
+
+    // stops at the left/right edge
+    char maxD = (dir > 0)
+        ? std::min((int)maxSearchD, (int)((this->width - 1 - halfWindow) - x))
+        : std::min((int)maxSearchD, (int)(x - halfWindow));
+        //: std::min((int)(this->width - 1 - maxSearchD), (int)(this->width - 1 - x - halfWindow));
+
+    for (int d = 0; d <= maxD; d++)
+    {
+        unsigned int rightAvg = otherImg.grayAverage(
+            x - halfWindow + (dir * d),
+            y - halfWindow,
+            windowSize,
+            windowSize);
+
+        /* Calculate ZNCC */
+
+        int upperSum = 0;
+        unsigned int lowerLeftSum = 0;
+        unsigned int lowerRightSum = 0;
+
+        /* Calculate ZNCC(x, y, d) */
+        for (int wy = -halfWindow; wy <= halfWindow; wy++) // 20
+        {
+            for (int wx = -halfWindow; wx <= halfWindow; wx++) // 20
+            {
+                // difference of (left/right) image pixel from the average
+                // TODO: Not necessary for each d!
+                int leftDiff  = this->getGrayPixel(x + wx, y + wy) - leftAvg;
+                int rightDiff = otherImg.getGrayPixel(x + wx + (dir * d), y + wy) - rightAvg;
+
+                upperSum      += leftDiff * rightDiff;
+                lowerLeftSum  += leftDiff * leftDiff;     // leftDiff ^ 2
+                lowerRightSum += rightDiff * rightDiff;   // rightDiff ^ 2
+            }
+        }
+
+        // Finally calculate the ZNCC value
+        float correlation = (float)(upperSum / (sqrt(lowerLeftSum) * sqrt(lowerRightSum)));
+
+        // update disparity value for pixel (x,y)
+        if (correlation > maxCorrelation)
+        {
+            maxCorrelation = correlation;
+            bestD = d;
+        }
+    }
+
+    return bestD;
+}
+
+/**
+ * This is the thread that performs the ZNCC (disparity) calculation. This can
+ * be used either for sequential or threaded implementation. The args struct
+ * defines how the calculation is done. In case of sequential implementation,
+ * args defines the whole image as a calculation area, whereas in threaded
+ * version, the image is split to horizontal "strips".
+ * 
+ * @param args  Pointer to the structure containing the arguments.
+ * @return nullptr
+ */
+void *Image::calculateZNCC_thread(ZNCCArgs *args)
+{
+    const char halfWindow = (args->windowSize - 1) / 2;
+
+#ifndef USE_THREADS
+    float progress = 0.0f;
+    float progressPerRound = 1.0f / this->height;
+
+    #ifdef USE_OMP
+    # pragma omp parallel for
+    #endif
+#endif /* !USE_THREADS */
+
+    for (int y = args->fromY; y <= (int)args->toY; y++)
+    {
+        //cout << "Thread: " << args->tid << ", y = " << y << endl;
+        for (int x = halfWindow; x < (int)(this->width - halfWindow); x++)
+        {
+            // put the best disparity value to the disparity map
+            args->disparityMap->putPixel(x, y, this->znccDisparity(
+                *args->otherImg, x, y, args->windowSize, args->dir, args->maxSearchD));
+        }
+#ifndef USE_THREADS
+        progress += progressPerRound;
+        cout << "Calculating ZNCC... " << (unsigned int)(100 * progress) << " %\r" << std::flush;
+#endif /* !USE_THREADS */
+    }
+
+#ifdef USE_THREADS
+    pthread_exit(NULL);
+#endif /* USE_THREADS */
+
+    return nullptr;
+}
+
+/**
+ * Proxies the call to the actual thread function. This is used to
+ * extract the Image context before calling the method. This is necessary, as
+ * the pthread_create interface is quite strict.
+ * 
+ * @param args  Pointer to the structure containing the arguments.
+ * @return nullptr
+ **/
+void *calculateZNCC_thread_proxy(void *args)
+{
+    ZNCCArgs *a = static_cast<ZNCCArgs*>(args);
+    return static_cast<Image*>(a->thisImg)->calculateZNCC_thread(static_cast<ZNCCArgs*>(a));
+}
+
+/**
+ * Performs a cross-checking for two disparity maps of the same size.
+ * The result is stored as an image.
+ * 
+ * @param left       The left-to-right disparity map.
+ * @param right      The right-to-left disparity map.
+ * @param threshold  The difference threshold. Default is 8.
+ * @return           True on success, false on fail.
+ */
+bool Image::crossCheck(Image &left, Image &right, int threshold /* = 8 */)
 {
-    /**
-     * This method has three different calculation methods:
-     * 1. Sequential (normal CPU execution).
-     * 2. Parallel on CPU, using Pthread.
-     * 3. Parallel on GPU or CPU, using OpenCL.
-     */
-    disparityMap->createEmpty(otherImg.width, otherImg.height);
+    /*
+    Cross checking is a process where you compare two depth maps.
 
-    if (windowSize % 2 == 0)
-    {
-        cout << "Window size must be odd." << endl;
+    To obtain a consolidated map, the process consists in checking that the corresponding
+    pixels in the left and right disparity images are consistent. This can be done by comparing
+    their absolute difference to a threshold value. For our case, it is recommended to start
+    with a threshold value of 8, while the best threshold value for your implementation can
+    be obtained by experimentation. If the absolute difference is larger than the threshold,
+    then replace the pixel value with zero. Otherwise the pixel value remains unchanged.
+    This process helps in removing the probable lack of consistency between the depth maps
+    due to occlusions, noise, or algorithmic limitation.
+
+    If the absolute difference is larger than the threshold,
+    then replace the pixel value with zero. Otherwise the pixel value remains unchanged.
+
+    Spacha: I assume that the "otherwise the pixel remains unchanged" means that we
+    pick one from either left or right picture? We'll pick from the left image.
+    What about averaging between the two images?
+    */
+    bool success;
+    cout << "Performing cross-check... ";
+
+    // the disparity maps must be exactly the same size
+    if (left.width != right.width || left.height != right.height || left.singleChannel != right.singleChannel)
+        return false;
+
+    this->createEmpty(left.width, left.height);
+
+#ifdef USE_OCL /* OpenCL (GPU or CPU) */
+
+    if (!ocl) {
+        cout << "Cannot do parallel execution without instance of MiniOCL." << endl;
         return false;
     }
 
-    const char halfWindow = (windowSize - 1) / 2;
-    char dir = reverse ? 1 : -1;  // d = -1 -> move left (default), d = +1 -> move right
+    // the disparity maps are usually still on the device from calcZNCC()
+    success = ocl->useKernel("cross_check");
 
-#ifndef USE_THREADS
-    // arguments for calculating the whole picture in one thread
-    ZNCCArgs *args = new ZNCCArgs(0, windowSize, halfWindow, (unsigned int)this->height - halfWindow - 1, dir, maxSearchD, this, otherImg, disparityMap);
+    ocl->setBuffer(
+        0, left.toDevice());                                                        // left image in
+    ocl->setBuffer(
+        1, right.toDevice());                                                       // right image in
+    ocl->setBuffer(
+        2, this->deviceOutput());                                                   // image out
+    ocl->setValue(
+        3, (void*)&left.width, sizeof(int));                                        // image width
+    ocl->setValue(
+        4, (void*)&left.height, sizeof(int));                                       // image height
+    ocl->setValue(
+        5, (void *)&threshold, sizeof(unsigned int));                               // threshold
+
+    success = success && ocl->enqueueKernel(width, height, OCL_LOCAL_AUTO, OCL_LOCAL_AUTO);
+
+    if (!success)
+        return false;
+
+#else /* No parallelization */
+
+    #ifdef USE_OMP
+    # pragma omp parallel for
+    #endif
+    for (int y = 0; y < (int)this->height; y++)
+    {
+        for (int x = 0; x < (int)this->width; x++)
+        {
+            unsigned char leftPixel = left.getGrayPixel(x, y);
+
+            // If there is a sufficiently large difference between the images,
+            // replace the pixel with tranparent black pixel.
+            if (std::abs(leftPixel - right.getGrayPixel(x, y)) > threshold)
+            {
+                this->putPixel(x, y, (unsigned char)0);
+            } else {
+                this->putPixel(x, y, leftPixel);
+            }
+        }
+    }
+
+    success = true;
 #endif
 
+    cout << "Done." << endl;
+    return success;
+}
+
+/**
+ * Removes speckles, i.e. small regions that differ from their surroundings,
+ * by setting them to zero (to be filled by occlusionFill). A region is a
+ * 4-connected set of non-zero pixels where the neighbours differ by at most
+ * @tolerance. The regions are labeled with union-find: bands of rows are
+ * labeled in parallel (with OpenMP; serially on the other host targets) and
+ * then joined across the band borders, so the whole labeling is linear in the
+ * number of pixels. With OpenCL, this is done on the host.
+ * 
+ * @param maxSize   Regions of at most this many pixels are removed. 0 leaves
+ *                  the image as is.
+ * @param tolerance Largest difference of neighbouring pixels in a region.
+ * @return          True on success, false on fail.
+ */
+bool Image::removeSpeckles(unsigned int maxSize, int tolerance)
+{
+    cout << "Removing speckles... ";
+
+    if (!singleChannel) {
+        cout << "Error! Speckles can be removed only from grayscale images." << endl;
+        return false;
+    }
+
+    if (maxSize == 0) {
+        cout << "Done." << endl;
+        return true;
+    }
+
 #ifdef USE_OCL /* OpenCL (GPU or CPU) */
 
+    if (!ocl) {
+        cout << "Cannot do parallel execution without instance of MiniOCL." << endl;
+        return false;
+    }
+
+    // the labeling is done on the host
+    if (!this->toHost())
+        return false;
+
+#endif
+
+    const int w = (int)this->width;
+    const int h = (int)this->height;
+    const int bandHeight = 64;
+    const int bands = (h + bandHeight - 1) / bandHeight;
+    const unsigned char *pixels = image.data();
+
+    std::vector<int> labels(image.size());
+    int *parent = labels.data();
+
+    // 1. each band of rows separately (no set crosses a band yet)
+    #ifdef USE_OMP
+    # pragma omp parallel for
+    #endif
+    for (int band = 0; band < bands; band++)
+    {
+        const int y0 = band * bandHeight;
+        const int y1 = std::min(h, y0 + bandHeight);
+
+        for (int y = y0; y < y1; y++)
+        {
+            for (int x = 0; x < w; x++)
+            {
+                const int i = y * w + x;
+                parent[i] = i;
+
+                if (pixels[i] == 0) continue;
+
+                if (x > 0 && pixels[i - 1] > 0 && std::abs(pixels[i] - pixels[i - 1]) <= tolerance)
+                    unite(parent, i, i - 1);
+
+                if (y > y0 && pixels[i - w] > 0 && std::abs(pixels[i] - pixels[i - w]) <= tolerance)
+                    unite(parent, i, i - w);
+            }
+        }
+    }
+
+    // 2. join the sets across the band borders
+    for (int band = 1; band < bands; band++)
+    {
+        const int y = band * bandHeight;
+
+        for (int x = 0; x < w; x++)
+        {
+            const int i = y * w + x;
+
+            if (pixels[i] > 0 && pixels[i - w] > 0 && std::abs(pixels[i] - pixels[i - w]) <= tolerance)
+                unite(parent, i, i - w);
+        }
+    }
+
+    // 3. point each pixel to its root (the parents come first) and count the
+    //    pixels of each region
+    std::vector<unsigned int> sizes(image.size(), 0);
+
+    for (int i = 0; i < w * h; i++)
+    {
+        parent[i] = parent[parent[i]];
+        sizes[parent[i]]++;
+    }
+
+    // 4. clear the small regions
+    this->detachHost();
+
+    #ifdef USE_OMP
+    # pragma omp parallel for
+    #endif
+    for (int i = 0; i < w * h; i++)
+    {
+        if (image[i] > 0 && sizes[parent[i]] <= maxSize)
+            image[i] = 0;
+    }
+
+    deviceValid = false;
+
+    cout << "Done." << endl;
+    return true;
+}
+
+/**
+ * Performs an occlusion filling to the image. The image is overwritten.
+ * 
+ * @return       True on success, false on fail.
+ */
+bool Image::occlusionFill()
+{
+    /*
+    Occlusion filling is the process of eliminating the pixels that have been
+    assigned to zero by the previously calculated cross-checking. In the simplest
+    form it can be done by replacing each pixel with zero value with the nearest
+    non-zero pixel value. However, in this exercise it is recommended that you
+    experiment with other more complex postprocessing approaches that obtain the
+    pixel value in different forms.
+
+    Some ideas:
+        - take the pixel from left (or right if on the left edge)
+        - take the average of the surrounding pixels (interpolate)...
+    */
     bool success;
+    cout << "Performing occlusion fill... ";
+
+#ifdef USE_OCL /* OpenCL (GPU or CPU) */
 
     if (!ocl) {
         cout << "Cannot do parallel execution without instance of MiniOCL." << endl;
         return false;
     }
 
-    success = ocl->buildKernel("calc_zncc");
+# if OCCLUSION_FILL == FILL_EUCLIDEAN
 
-    ocl->setInputImageBuffer(
-        0, static_cast<void *>(image.data()), width, height, singleChannel);                // this image in
-    ocl->setInputImageBuffer(
-        1, static_cast<void *>(otherImg.image.data()), width, height, singleChannel);       // other image in
-    ocl->setOutputImageBuffer(
-        2, static_cast<void *>(disparityMap->image.data()), width, height, singleChannel);  // image out (disparity map)
-    ocl->setValue(
-        3, (void*)&width, sizeof(int));                                                     // image width
+    // the distance transform is done on the host
+    if (!this->toHost())
+        return false;
+
+    this->fillEuclidean();
+    success = true;
+
+# else
+
+    // the kernel reads the neighbours, so the output must be a separate buffer
+    cl_mem filledBuffer = ocl->createBuffer(sizeBytes());
+
+#  if OCCLUSION_FILL == FILL_LEFT
+
+    // a single scan over each row
+    success = ocl->useKernel("occlusion_scan_left");
+
+    ocl->setBuffer(
+        0, this->toDevice());                                                   // image in
+    ocl->setBuffer(
+        1, filledBuffer);                                                       // image out
     ocl->setValue(
-        4, (void*)&height, sizeof(int));                                                    // image height
+        2, (void*)&width, sizeof(int));                                         // image width
     ocl->setValue(
-        5, (void *)&args->windowSize, sizeof(const char));                                  // window size
+        3, (void*)&height, sizeof(int));                                        // image height
+
+    success = success && ocl->enqueueKernel(height, 1, OCL_LOCAL_AUTO, OCL_LOCAL_AUTO);
+
+#  else /* FILL_NEAREST */
+
+    // the nearest pixel found so far for each pixel (see occlusion_scan_lines)
+    cl_mem nearestBuffer = ocl->createBuffer(width * height * sizeof(cl_uint));
+    success = ocl->fillBuffer(nearestBuffer, 0xFF, width * height * sizeof(cl_uint));
+
+    // rows, columns and both diagonals; one work item per line
+    const size_t lines[4] = { height, width, width + height - 1, width + height - 1 };
+
+    for (int family = 0; family < 4 && success; family++)
+    {
+        success = ocl->useKernel("occlusion_scan_lines");
+
+        ocl->setBuffer(
+            0, this->toDevice());                                               // image in
+        ocl->setBuffer(
+            1, nearestBuffer);                                                  // nearest pixels
+        ocl->setValue(
+            2, (void*)&width, sizeof(int));                                     // image width
+        ocl->setValue(
+            3, (void*)&height, sizeof(int));                                    // image height
+        ocl->setValue(
+            4, (void*)&family, sizeof(int));                                    // line family
+
+        success = success && ocl->enqueueKernel(lines[family], 1, OCL_LOCAL_AUTO, OCL_LOCAL_AUTO);
+    }
+
+    success = success && ocl->useKernel("occlusion_scan_resolve");
+
+    ocl->setBuffer(
+        0, this->toDevice());                                                   // image in
+    ocl->setBuffer(
+        1, nearestBuffer);                                                      // nearest pixels
+    ocl->setBuffer(
+        2, filledBuffer);                                                       // image out
     ocl->setValue(
-        6, (void *)&args->dir, sizeof(char));                                               // direction
+        3, (void*)&width, sizeof(int));                                         // image width
     ocl->setValue(
-        7, (void *)&args->maxSearchD, sizeof(unsigned int));                                // max search distance
+        4, (void*)&height, sizeof(int));                                        // image height
 
-    success = ocl->executeKernel(width, height, 16, 16);
+    success = success && ocl->enqueueKernel(width, height, OCL_LOCAL_AUTO, OCL_LOCAL_AUTO);
+
+    // the queue is in order, so the buffer can be reused by later commands
+    ocl->releaseBuffer(nearestBuffer);
+
+#  endif
+
+    this->adoptDeviceBuffer(filledBuffer);
 
     if (!success)
         return false;
 
-#else /* Use Pthread or no parallelization. */
-# ifdef USE_THREADS /* Use Pthread */
-
-    pthread_t threads[NUM_THREADS];     // holds the thread handles
-    ZNCCArgs *args[NUM_THREADS];        // holds the thread arguments
+# endif
 
-    // For example, 8 threads.
-    // We will divide the image to NUM_THREADS equal horizontal strips.
-    // Each strip is a working area of one thread.
-    // The height of each strip must be LARGER THAN OR EQUAL TO the window size.
-    if (this->height <= NUM_THREADS * windowSize)
-    {
-        cout << "Error! Too small picture for " << NUM_THREADS << " threads!" << endl;
-        return false; // TODO: free args still...
-    }
+#else /* No parallelization */
 
-    unsigned int rowsPerThread = this->height / NUM_THREADS; // 504 / 8 = 63
-    unsigned int fromY = halfWindow;
-    unsigned int toY = rowsPerThread - 1;
+# if OCCLUSION_FILL == FILL_LEFT
 
-    for (int i = 0; i < NUM_THREADS; i++)
+    #ifdef USE_OMP
+    # pragma omp parallel for
+    #endif
+    for (int y = 0; y < (int)this->height; y++)
     {
-        // threadId, windowSize, dir, maxSearchD, fromY, toY, thisImg, otherImg, disparityMap
-        args[i] = new ZNCCArgs(i, windowSize, fromY, toY, dir, maxSearchD, this, otherImg, disparityMap);
-        int err = pthread_create(&threads[i], NULL, calculateZNCC_thread_proxy, (void *)args[i]);
-        if (err) {
-            cout << "Error! Unable to create thread: " << err << endl;
-            break;
-        }
-        //cout << "\tThread " << i << " created." << endl;
+        for (int x = 0; x < (int)this->width; x++)
+        {
+            unsigned char p = this->getGrayPixel(x, y);
 
-        fromY = toY + 1;
-        toY = fromY + rowsPerThread - 1;
+            if (p > 0) continue;
 
-        // if next is the last thread (lowest part)
-        if (i == (NUM_THREADS - 2))
-            toY -= halfWindow;
-    }
+            for (int x0 = x; x0 >= 0; x0--)
+            {
+                unsigned char p0 = this->getGrayPixel(x0, y);
 
-    // Wait for threads to finish; after finish, delete its argument struct.
-    for (int i = 0; i < NUM_THREADS; i++)
-    {
-        pthread_join(threads[i], NULL);
-        //cout << "\tThread " << i << " done." << endl;
-        delete args[i];
+                if (p0 > 0)
+                {
+                    // replace current pixel (that is zero) with p0
+                    this->putPixel(x, y, p0);
+                    break;
+                }
+            }
+        }
     }
 
-# else /* No parallelization */
+# elif OCCLUSION_FILL == FILL_NEAREST
+
+    this->fillNearest();
+
+# else /* FILL_EUCLIDEAN */
 
-    // Execute in a single "thread" using the same
-    // proxy as the Pthread implementation.
-    calculateZNCC_thread_proxy(args);
+    this->fillEuclidean();
 
 # endif
-#endif
 
-#ifndef USE_THREADS
-    delete args;
+    success = true;
 #endif
 
-    cout << "Calculating ZNCC... Done.\r" << endl;
-    return true;
+    cout << "Done." << endl;
+    return success;
 }
 
 /**
- * This is the thread that performs the ZNCC (disparity) calculation. This can
- * be used either for sequential or threaded implementation. The args struct
- * defines how the calculation is done. In case of sequential implementation,
- * args defines the whole image as a calculation area, whereas in threaded
- * version, the image is split to horizontal "strips".
- * 
- * @param args  Pointer to the structure containing the arguments.
- * @return nullptr
+ * Replaces each zero pixel with the nearest non-zero pixel in the 8
+ * directions, exactly like occlusion_scan_lines and occlusion_scan_resolve do
+ * with OpenCL. Each row, column and diagonal is scanned both ways carrying the
+ * last non-zero pixel, and the candidates are packed as
+ * (distance << 12 | rank << 8 | value), so that the minimum is the pixel the
+ * spiral search picks. O(w * h) in total, and the lines of a family are
+ * independent (threaded with OpenMP only, like the other host steps).
  */
-void *Image::calculateZNCC_thread(ZNCCArgs *args)
+void Image::fillNearest()
 {
-    const char halfWindow = (args->windowSize - 1) / 2;
-
-#ifndef USE_THREADS
-    float progress = 0.0f;
-    float progressPerRound = 1.0f / this->height;
+    const int w = (int)this->width;
+    const int h = (int)this->height;
 
-    #ifdef USE_OMP
-    # pragma omp parallel for
-    #endif
-#endif /* !USE_THREADS */
+    // the nearest pixel found so far for each pixel
+    std::vector<unsigned int> best(image.size(), 0xFFFFFFFF);
 
-    for (int y = args->fromY; y <= (int)args->toY; y++)
+    // rows, columns, diagonals down-right and up-right
+    for (int family = 0; family < 4; family++)
     {
-        //cout << "Thread: " << args->tid << ", y = " << y << endl;
-        for (int x = halfWindow; x < (int)(this->width - halfWindow); x++)
-        {
-            unsigned int leftAvg = this->grayAverage(
-                x - halfWindow,
-                y - halfWindow,
-                args->windowSize,
-                args->windowSize);
-
-            unsigned char bestD = 0;        // tracks the distance with best correlation
-            float maxCorrelation = 0.0f;    // tracks the best correlation (ZNCC)
-
-            // stops at the left/right edge
-            char maxD = (args->dir > 0)
-                ? std::min((int)args->maxSearchD, (int)((this->width - 1 - halfWindow) - x))
-                : std::min((int)args->maxSearchD, (int)(x - halfWindow));
-                //: std::min((int)(this->width - 1 - maxSearchD), (int)(this->width - 1 - x - halfWindow));
-
-            for (int d = 0; d <= maxD; d++)
-            {
-                unsigned int rightAvg = args->otherImg.grayAverage(
-                    x - halfWindow + (args->dir * d),
-                    y - halfWindow,
-                    args->windowSize,
-                    args->windowSize);
+        const int lines = (family == 0) ? h : (family == 1) ? w : w + h - 1;
 
-                /* Calculate ZNCC */
+        #ifdef USE_OMP
+        # pragma omp parallel for
+        #endif
+        for (int line = 0; line < lines; line++)
+        {
+            int x0, y0, stepX, stepY, length;
+            unsigned int rankForward, rankBackward;     // rank of the direction of the carried pixel
+            int maxDistance = w + h;
+
+            if (family == 0) {
+                x0 = 0; y0 = line; stepX = 1; stepY = 0; length = w;
+                rankForward = 1; rankBackward = 7;
+            } else if (family == 1) {
+                x0 = line; y0 = 0; stepX = 0; stepY = 1; length = h;
+                rankForward = 3; rankBackward = 5;
+                maxDistance = w;                        // the spiral searches only w steps
+            } else if (family == 2) {
+                x0 = (line < h) ? 0 : line - h + 1;
+                y0 = (line < h) ? h - 1 - line : 0;
+                stepX = 1; stepY = 1; length = std::min(w - x0, h - y0);
+                rankForward = 0; rankBackward = 8;
+            } else {
+                x0 = (line < h) ? 0 : line - h + 1;
+                y0 = (line < h) ? line : h - 1;
+                stepX = 1; stepY = -1; length = std::min(w - x0, y0 + 1);
+                rankForward = 2; rankBackward = 6;
+            }
 
-                int upperSum = 0;
-                unsigned int lowerLeftSum = 0;
-                unsigned int lowerRightSum = 0;
+            // forward, then backward along the line
+            for (int pass = 0; pass < 2; pass++)
+            {
+                int last = -1;
+                unsigned int lastClr = 0;
 
-                /* Calculate ZNCC(x, y, d) */
-                for (int wy = -halfWindow; wy <= halfWindow; wy++) // 20
+                for (int i = 0; i < length; i++)
                 {
-                    for (int wx = -halfWindow; wx <= halfWindow; wx++) // 20
-                    {
-                        // difference of (left/right) image pixel from the average
-                        // TODO: Not necessary for each d!
-                        int leftDiff  = this->getGrayPixel(x + wx, y + wy) - leftAvg;
-                        int rightDiff = args->otherImg.getGrayPixel(x + wx + (args->dir * d), y + wy) - rightAvg;
-
-                        upperSum      += leftDiff * rightDiff;
-                        lowerLeftSum  += leftDiff * leftDiff;     // leftDiff ^ 2
-                        lowerRightSum += rightDiff * rightDiff;   // rightDiff ^ 2
+                    const int k = (pass == 0) ? i : length - 1 - i;
+                    const int idx = (y0 + k * stepY) * w + (x0 + k * stepX);
+                    const unsigned char clr = image[idx];
+
+                    if (clr > 0) {
+                        last = i;
+                        lastClr = clr;
+                    } else if (last >= 0 && i - last < maxDistance) {
+                        const unsigned int rank = (pass == 0) ? rankForward : rankBackward;
+                        best[idx] = std::min(best[idx], ((unsigned int)(i - last) << 12) | (rank << 8) | lastClr);
                     }
                 }
-
-                // Finally calculate the ZNCC value
-                float correlation = (float)(upperSum / (sqrt(lowerLeftSum) * sqrt(lowerRightSum)));
-
-                // update disparity value for pixel (x,y)
-                if (correlation > maxCorrelation)
-                {
-                    maxCorrelation = correlation;
-                    bestD = d;
-                }
             }
-
-            // put the best disparity value to the disparity map
-            args->disparityMap->putPixel(x, y, bestD);
         }
-#ifndef USE_THREADS
-        progress += progressPerRound;
-        cout << "Calculating ZNCC... " << (unsigned int)(100 * progress) << " %\r" << std::flush;
-#endif /* !USE_THREADS */
     }
 
-#ifdef USE_THREADS
-    pthread_exit(NULL);
-#endif /* USE_THREADS */
+    // the non-zero pixels are kept, zero ones without any candidate stay black
+    this->detachHost();
 
-    return nullptr;
-}
+    #ifdef USE_OMP
+    # pragma omp parallel for
+    #endif
+    for (int i = 0; i < w * h; i++)
+    {
+        if (image[i] == 0 && best[i] != 0xFFFFFFFF)
+            image[i] = (unsigned char)(best[i] & 0xFF);
+    }
 
-/**
- * Proxies the call to the actual thread function. This is used to
- * extract the Image context before calling the method. This is necessary, as
- * the pthread_create interface is quite strict.
- * 
- * @param args  Pointer to the structure containing the arguments.
- * @return nullptr
- **/
-void *calculateZNCC_thread_proxy(void *args)
-{
-    ZNCCArgs *a = static_cast<ZNCCArgs*>(args);
-    return static_cast<Image*>(a->thisImg)->calculateZNCC_thread(static_cast<ZNCCArgs*>(a));
+    deviceValid = false;
 }
 
 /**
- * Performs a cross-checking for two disparity maps of the same size.
- * The result is stored as an image.
- * 
- * @param left       The left-to-right disparity map.
- * @param right      The right-to-left disparity map.
- * @param threshold  The difference threshold. Default is 8.
- * @return           True on success, false on fail.
+ * Replaces each zero pixel with the nearest (in Euclidean distance) non-zero
+ * pixel, using a separable exact distance transform that also tracks the
+ * nearest pixel (Felzenszwalb & Huttenlocher). First, the nearest non-zero
+ * pixel of each column is found for every row; then, for each row, the lower
+ * envelope of the parabolas rooted at those pixels gives the nearest one in
+ * 2D. O(w * h) in total, and the columns and the rows are independent. They
+ * are threaded with OpenMP (TARGET_OMP) only; with TARGET_PTHREAD, where only
+ * the ZNCC is threaded, the transform runs on one thread.
+ * If there are no non-zero pixels, the image is left as is.
  */
-bool Image::crossCheck(Image &left, Image &right, int threshold /* = 8 */)
+void Image::fillEuclidean()
 {
-    /*
-    Cross checking is a process where you compare two depth maps.
-
-    To obtain a consolidated map, the process consists in checking that the corresponding
-    pixels in the left and right disparity images are consistent. This can be done by comparing
-    their absolute difference to a threshold value. For our case, it is recommended to start
-    with a threshold value of 8, while the best threshold value for your implementation can
-    be obtained by experimentation. If the absolute difference is larger than the threshold,
-    then replace the pixel value with zero. Otherwise the pixel value remains unchanged.
-    This process helps in removing the probable lack of consistency between the depth maps
-    due to occlusions, noise, or algorithmic limitation.
+    const int w = (int)this->width;
+    const int h = (int)this->height;
 
-    If the absolute difference is larger than the threshold,
-    then replace the pixel value with zero. Otherwise the pixel value remains unchanged.
+    // 1. the nearest non-zero row in the same column (-1 if none)
+    std::vector<int> nearestY(image.size(), -1);
 
-    Spacha: I assume that the "otherwise the pixel remains unchanged" means that we
-    pick one from either left or right picture? We'll pick from the left image.
-    What about averaging between the two images?
-    */
-    bool success;
-    cout << "Performing cross-check... ";
+    #ifdef USE_OMP
+    # pragma omp parallel for
+    #endif
+    for (int x = 0; x < w; x++)
+    {
+        int last = -1;
 
-    // the disparity maps must be exactly the same size
-    if (left.width != right.width || left.height != right.height || left.singleChannel != right.singleChannel)
-        return false;
+        for (int y = 0; y < h; y++)
+        {
+            if (image[y * w + x] > 0) last = y;
+            nearestY[y * w + x] = last;
+        }
 
-    this->createEmpty(left.width, left.height);
+        last = -1;
 
-#ifdef USE_OCL /* OpenCL (GPU or CPU) */
+        for (int y = h - 1; y >= 0; y--)
+        {
+            if (image[y * w + x] > 0) last = y;
 
-    if (!ocl) {
-        cout << "Cannot do parallel execution without instance of MiniOCL." << endl;
-        return false;
+            const int above = nearestY[y * w + x];
+            if (last >= 0 && (above < 0 || last - y < y - above))
+                nearestY[y * w + x] = last;
+        }
     }
 
-    success = ocl->buildKernel("cross_check");
-
-    ocl->setInputImageBuffer(
-        0, static_cast<void *>(left.image.data()), width, height, singleChannel);   // left image in
-    ocl->setInputImageBuffer(
-        1, static_cast<void *>(right.image.data()), width, height, singleChannel);  // right image in
-    ocl->setOutputImageBuffer(
-        2, static_cast<void *>(image.data()), width, height, singleChannel);        // image out
-    ocl->setValue(
-        3, (void*)&left.width, sizeof(int));                                        // image width
-    ocl->setValue(
-        4, (void*)&left.height, sizeof(int));                                       // image height
-    ocl->setValue(
-        5, (void *)&threshold, sizeof(unsigned int));                               // threshold
-
-    success = ocl->executeKernel(width, height, 16, 16);
-
-    if (!success)
-        return false;
-
-#else /* No parallelization */
+    // 2. for each row, the lower envelope of the parabolas
+    //    (x - q)^2 + (nearestY(q) - y)^2 of the columns q with a non-zero pixel
+    std::vector<unsigned char> filled(image.size());
 
     #ifdef USE_OMP
     # pragma omp parallel for
     #endif
-    for (int y = 0; y < (int)this->height; y++)
+    for (int y = 0; y < h; y++)
     {
-        for (int x = 0; x < (int)this->width; x++)
+        const int *sites = &nearestY[y * w];
+        std::vector<int> columns(w);            // columns of the parabolas in the envelope
+        std::vector<double> bounds(w + 1);      // where each parabola starts to be the lowest
+        int k = -1;
+
+        for (int q = 0; q < w; q++)
         {
-            unsigned char leftPixel = left.getGrayPixel(x, y);
+            if (sites[q] < 0) continue;
 
-            // If there is a sufficiently large difference between the images,
-            // replace the pixel with tranparent black pixel.
-            if (std::abs(leftPixel - right.getGrayPixel(x, y)) > threshold)
+            const double fq = (double)(sites[q] - y) * (sites[q] - y) + (double)q * q;
+            double s = 0.0;
+
+            // drop the parabolas that the new one hides
+            while (k >= 0)
             {
-                this->putPixel(x, y, (unsigned char)0);
-            } else {
-                this->putPixel(x, y, leftPixel);
+                const int p = columns[k];
+                const double fp = (double)(sites[p] - y) * (sites[p] - y) + (double)p * p;
+
+                s = (fq - fp) / (2.0 * (q - p));
+                if (s > bounds[k]) break;
+                k--;
             }
+
+            k++;
+            columns[k] = q;
+            bounds[k] = (k == 0) ? -HUGE_VAL : s;
+            bounds[k + 1] = HUGE_VAL;
         }
-    }
 
-    success = true;
-#endif
+        // no non-zero pixels in the image at all
+        if (k < 0)
+        {
+            std::copy(&image[y * w], &image[y * w] + w, &filled[y * w]);
+            continue;
+        }
 
-    cout << "Done." << endl;
-    return success;
+        for (int x = 0, j = 0; x < w; x++)
+        {
+            while (bounds[j + 1] < x) j++;
+
+            filled[y * w + x] = image[sites[columns[j]] * w + columns[j]];
+        }
+    }
+
+    this->detachHost();
+    this->image.swap(filled);
+    deviceValid = false;
 }
 
 /**
- * Performs an occlusion filling to the image. The image is overwritten.
+ * Applies a median filter to the (grayscale) image. The window is
+ * (2 * radius + 1)^2 pixels and the edges are clamped, i.e. the border pixels
+ * are repeated. With OpenCL, windows up to MEDIAN_OCL_MAX_RADIUS are filtered
+ * on the device; larger ones are read back and filtered on the host.
  * 
+ * @param radius Radius of the window, at most 127. 0 leaves the image as is.
  * @return       True on success, false on fail.
  */
-bool Image::occlusionFill()
+bool Image::filterMedian(unsigned int radius)
 {
-    /*
-    Occlusion filling is the process of eliminating the pixels that have been
-    assigned to zero by the previously calculated cross-checking. In the simplest
-    form it can be done by replacing each pixel with zero value with the nearest
-    non-zero pixel value. However, in this exercise it is recommended that you
-    experiment with other more complex postprocessing approaches that obtain the
-    pixel value in different forms.
-
-    Some ideas:
-        - take the pixel from left (or right if on the left edge)
-        - take the average of the surrounding pixels (interpolate)...
-    */
     bool success;
-    cout << "Performing occlusion fill... ";
+    cout << "Performing median filtering... ";
+
+    if (!singleChannel) {
+        cout << "Error! Median filter works only for grayscale images." << endl;
+        return false;
+    }
+
+    // the window counts must fit in 16 bits (see medianHistogram)
+    if (radius > 127) {
+        cout << "Error! Too large median filter radius " << radius << "." << endl;
+        return false;
+    }
+
+    if (radius == 0) {
+        cout << "Done." << endl;
+        return true;
+    }
 
 #ifdef USE_OCL /* OpenCL (GPU or CPU) */
 
@@ -783,56 +2593,232 @@ bool Image::occlusionFill()
         return false;
     }
 
-    // Options: occlusion_fill_left, occlusion_fill_nearest
-    success = ocl->buildKernel("occlusion_fill_nearest");
+    if (radius <= MEDIAN_OCL_MAX_RADIUS)
+    {
+        // the window is gathered to private memory, so its size is built in
+        cl_mem filteredBuffer = ocl->createBuffer(sizeBytes());
+        success = ocl->useKernel("median_filter", "-DMEDIAN_RADIUS=" + std::to_string(radius));
 
-    // the same image is used as input and output
-    ocl->setInputImageBuffer(
-        0, static_cast<void *>(image.data()), width, height, singleChannel);
-    ocl->setOutputImageBuffer(
-        1, static_cast<void *>(image.data()), width, height, singleChannel);
-    ocl->setValue(
-        2, (void*)&width, sizeof(int));
-    ocl->setValue(
-        3, (void*)&height, sizeof(int));
+        ocl->setBuffer(
+            0, this->toDevice());                                               // image in
+        ocl->setBuffer(
+            1, filteredBuffer);                                                 // image out
+        ocl->setValue(
+            2, (void*)&width, sizeof(int));                                     // image width
+        ocl->setValue(
+            3, (void*)&height, sizeof(int));                                    // image height
 
-    success = ocl->executeKernel(width, height, 16, 16);
+        success = success && ocl->enqueueKernel(width, height, OCL_LOCAL_AUTO, OCL_LOCAL_AUTO);
 
-    if (!success)
+        this->adoptDeviceBuffer(filteredBuffer);
+
+        cout << "Done." << endl;
+        return success;
+    }
+
+    // larger windows are filtered on the host
+    if (!this->toHost())
         return false;
 
-#else /* No parallelization */
+#endif
+
+    this->medianHistogram(radius);
+    success = true;
+
+    cout << "Done." << endl;
+    return success;
+}
+
+/**
+ * Median filter whose cost per pixel does not depend on the radius
+ * (Perreault & Hebert). Each column keeps a histogram of the 2 * radius + 1
+ * pixels around the current row, split to a coarse (16 bins of 16 values)
+ * and a fine (256 bins) level. Along the row, only the coarse window
+ * histogram slides by the entering and the leaving column; the 16 fine bins
+ * of a coarse bin are refreshed lazily, when the median search lands in it,
+ * by replaying the columns passed since its last use (or rebuilding it if
+ * that is cheaper). Since the median moves little between neighbours, most
+ * pixels touch 16 coarse and a few fine bins. The image is split to column
+ * strips that are filtered in parallel with OpenMP (serially on the other
+ * host targets); the column histograms of a strip stay in the cache.
+ * 
+ * @param radius Radius of the window, at most 127.
+ */
+void Image::medianHistogram(unsigned int radius)
+{
+    const int w = (int)this->width;
+    const int h = (int)this->height;
+    const int r = (int)radius;
+    const int half = ((2 * r + 1) * (2 * r + 1)) / 2;    // rank of the median in the window
+    const int stripWidth = 128;
+    const int strips = (w + stripWidth - 1) / stripWidth;
+
+    std::vector<unsigned char> filtered(image.size());
 
     #ifdef USE_OMP
     # pragma omp parallel for
     #endif
-    for (int y = 0; y < (int)this->height; y++)
+    for (int strip = 0; strip < strips; strip++)
     {
-        for (int x = 0; x < (int)this->width; x++)
+        const int x0 = strip * stripWidth;
+        const int x1 = std::min(w, x0 + stripWidth);
+        const int columns = (x1 - x0) + 2 * r;           // x0 - r ... x1 + r - 1
+
+        // column histograms (fine: 256 bins, coarse: 16 bins)
+        std::vector<unsigned short> colFine(columns * 256, 0);
+        std::vector<unsigned short> colCoarse(columns * 16, 0);
+        std::vector<int> sourceX(columns);
+
+        for (int c = 0; c < columns; c++)
+            sourceX[c] = std::min(std::max(x0 - r + c, 0), w - 1);
+
+        // rows -r ... r of the first row
+        for (int c = 0; c < columns; c++)
         {
-            unsigned char p = this->getGrayPixel(x, y);
+            for (int dy = -r; dy <= r; dy++)
+            {
+                const unsigned char v = image[std::min(std::max(dy, 0), h - 1) * w + sourceX[c]];
+                colFine[c * 256 + v]++;
+                colCoarse[c * 16 + (v >> 4)]++;
+            }
+        }
 
-            if (p > 0) continue;
+        for (int y = 0; y < h; y++)
+        {
+            // move the column histograms down by a row
+            if (y > 0)
+            {
+                const unsigned char *leaving = &image[std::max(y - r - 1, 0) * w];
+                const unsigned char *entering = &image[std::min(y + r, h - 1) * w];
 
-            for (int x0 = x; x0 >= 0; x0--)
+                for (int c = 0; c < columns; c++)
+                {
+                    const unsigned char out = leaving[sourceX[c]];
+                    const unsigned char in = entering[sourceX[c]];
+                    colFine[c * 256 + out]--;
+                    colCoarse[c * 16 + (out >> 4)]--;
+                    colFine[c * 256 + in]++;
+                    colCoarse[c * 16 + (in >> 4)]++;
+                }
+            }
+
+            // the coarse window of the first pixel of the strip
+            unsigned short fine[256];
+            unsigned short coarse[16] = { 0 };
+            int refreshed[16];                          // window (c) the fine bins of a coarse bin are up to date for
+
+            for (int c = 0; c <= 2 * r; c++)
             {
-                unsigned char p0 = this->getGrayPixel(x0, y);
+                for (int i = 0; i < 16; i++) coarse[i] += colCoarse[c * 16 + i];
+            }
 
-                if (p0 > 0)
+            for (int i = 0; i < 16; i++)
+                refreshed[i] = -(2 * r + 2);            // stale, rebuilt on the first use
+
+            for (int x = x0; x < x1; x++)
+            {
+                // slide the coarse window: columns c ... c + 2r
+                const int c = x - x0;
+                if (c > 0)
                 {
-                    // replace current pixel (that is zero) with p0
-                    this->putPixel(x, y, p0);
-                    break;
+                    const unsigned short *inCoarse = &colCoarse[(c + 2 * r) * 16];
+                    const unsigned short *outCoarse = &colCoarse[(c - 1) * 16];
+
+                    for (int i = 0; i < 16; i++) coarse[i] += inCoarse[i] - outCoarse[i];
+                }
+
+                // the coarse bin of the median
+                int count = 0;
+                int bin = 0;
+                while (count + coarse[bin] <= half) count += coarse[bin++];
+
+                // bring its fine bins up to date
+                unsigned short *segment = &fine[bin * 16];
+                const int passed = c - refreshed[bin];
+
+                if (2 * passed > 2 * r + 1)
+                {
+                    // rebuilding costs 2r + 1 columns, replaying 2 per column passed
+                    for (int i = 0; i < 16; i++) segment[i] = 0;
+
+                    for (int k = c; k <= c + 2 * r; k++)
+                    {
+                        const unsigned short *col = &colFine[k * 256 + bin * 16];
+                        for (int i = 0; i < 16; i++) segment[i] += col[i];
+                    }
+                }
+                else
+                {
+                    for (int k = refreshed[bin] + 1; k <= c; k++)
+                    {
+                        const unsigned short *in = &colFine[(k + 2 * r) * 256 + bin * 16];
+                        const unsigned short *out = &colFine[(k - 1) * 256 + bin * 16];
+                        for (int i = 0; i < 16; i++) segment[i] += in[i] - out[i];
+                    }
                 }
+
+                refreshed[bin] = c;
+
+                // the first value whose cumulative count exceeds the rank
+                int value = bin * 16;
+                while (count + fine[value] <= half) count += fine[value++];
+
+                filtered[y * w + x] = (unsigned char)value;
             }
         }
     }
 
-    success = true;
+    this->detachHost();
+    this->image.swap(filtered);
+    deviceValid = false;
+}
+
+/**
+ * Runs the whole stereo pipeline from the input images (RGBA or gray) to the
+ * occlusion filled and median filtered disparity map, which is stored to
+ * @disparityMap. The image is the left one. With OpenCL, the two inputs are
+ * uploaded once, all the intermediate images stay on the device, and only the
+ * final map is read back. The steps done on the host (the speckle removal,
+ * FILL_EUCLIDEAN and median radii above MEDIAN_OCL_MAX_RADIUS) read back
+ * their input too, and they are off by default. Both input images
+ * are downscaled to grayscale in place.
+ * 
+ * @param otherImg     The right image.
+ * @param disparityMap Pointer to a location to store the final disparity map.
+ * @param windowSize   Size of the ZNCC window (odd).
+ * @param maxSearchD   Maximum disparity to search (in downscaled pixels).
+ * @param factor       Downscaling factor.
+ * @param threshold    Cross-checking threshold.
+ * @return             True on success, false on fail.
+ */
+bool Image::calcStereoDisparity(Image &otherImg, Image *disparityMap, unsigned int windowSize, unsigned int maxSearchD,
+                                unsigned int factor /* = 1 */, int threshold /* = 8 */)
+{
+    bool success;
+
+    // both disparity maps are device-side intermediates
+    GrayImage leftDisparity;
+    GrayImage rightDisparity;
+
+    leftDisparity.setOpenCL(ocl);
+    rightDisparity.setOpenCL(ocl);
+    if (!disparityMap->ocl)
+        disparityMap->setOpenCL(ocl);
+
+    success = this->downScaleToGray(factor) &&
+              otherImg.downScaleToGray(factor) &&
+#if FUSED_CROSS_CHECK
+              this->calcZNCCCrossChecked(otherImg, disparityMap, windowSize, maxSearchD, threshold) &&
+#else
+              this->calcZNCCPair(otherImg, &leftDisparity, &rightDisparity, windowSize, maxSearchD) &&
+              disparityMap->crossCheck(leftDisparity, rightDisparity, threshold) &&
 #endif
+              disparityMap->removeSpeckles(SPECKLE_SIZE, SPECKLE_TOLERANCE) &&
+              disparityMap->occlusionFill() &&
+              disparityMap->filterMedian(MEDIAN_RADIUS);
 
-    cout << "Done." << endl;
-    return success;
+    // the only read-back of the pipeline, unless a host step is enabled
+    return success && disparityMap->toHost();
 }
 
 
@@ -2,6 +2,7 @@
 
 #include <math.h>
 #include <array>
+#include <memory>           // unique_ptr
 #include <iomanip>          // setw
 #include "Application.hpp"
 #include "Filters.hpp"
@@ -15,6 +16,9 @@
 #ifdef USE_OMP
 # include <omp.h>
 #endif /* USE_OMP */
+#ifdef __AVX2__
+# include <immintrin.h>
+#endif /* __AVX2__ */
 
 /* Forward declarations. */
 struct ZNCCArgs;
@@ -72,8 +76,16 @@ public:
     size_t width;                       // image width
     size_t height;                      // image height
     MiniOCL *ocl = nullptr;             // Handle to OpenCL wrapper class for parallel execution
+    cl_mem deviceBuffer = nullptr;      // copy of the image on the OpenCL device (if any)
+    size_t deviceSize = 0;              // size of deviceBuffer in bytes
+    bool hostValid = true;              // whether image (the host copy) is up to date
+    bool deviceValid = false;           // whether deviceBuffer (the device copy) is up to date
+    Event upload;                       // pending copy of image to deviceBuffer
+    bool deviceWrapsHost = false;       // whether deviceBuffer uses image directly (zero-copy)
 
     Image(bool singleChannel = false);
+    Image(const Image &) = delete;      // the device buffer cannot be shared
+    Image &operator=(const Image &) = delete;
     ~Image();
     void setOpenCL(MiniOCL *ocl);
     void setSingleChannel(bool singleChannel);
@@ -82,22 +94,42 @@ public:
     void createEmpty(size_t width, size_t height);
     void replace(Image &newImage, bool forceNew = false);
     bool load(const std::string &filename);
+    unsigned decodeGray(const std::vector<unsigned char> &png, unsigned &w, unsigned &h);
     bool save(const std::string &filename);
 
+    // host / device (OpenCL) synchronization
+    cl_mem toDevice();
+    cl_mem deviceOutput();
+    void adoptDeviceBuffer(cl_mem buffer);
+    bool toHost();
+    void releaseDevice();
+
     // image manipulation
     bool convertToGrayscale();
     bool filter(const Filter &filter);
+    bool filterBox(size_t size, float weight, float divisor);
+    bool filterFixedPoint(const Filter &filter);
+    bool filterSeparable(const Filter &filter);
     bool filterMean(size_t size);
     //bool resize(size_t width, size_t height);
     bool downScale(unsigned int factor);
+    bool downScaleToGray(unsigned int factor);
     bool calcZNCC(Image &otherImg, Image *disparityMap, unsigned int windowSize, unsigned int maxSearchD, bool reverse = false);
+    bool calcZNCCPair(Image &rightImg, Image *leftDisparity, Image *rightDisparity, unsigned int windowSize, unsigned int maxSearchD);
+    bool calcZNCCCrossChecked(Image &rightImg, Image *disparityMap, unsigned int windowSize, unsigned int maxSearchD,
+                              int threshold = 8);
+    bool calcZNCCMulti(Image &otherImg, Image *disparityMap, unsigned int windowSize, unsigned int maxSearchD, MultiOCL &multi, bool reverse = false);
     bool crossCheck(Image &left, Image &right, int threshold = 8);
+    bool removeSpeckles(unsigned int maxSize, int tolerance);
     bool occlusionFill();
+    bool filterMedian(unsigned int radius);
+    bool calcStereoDisparity(Image &otherImg, Image *disparityMap, unsigned int windowSize, unsigned int maxSearchD,
+                             unsigned int factor = 1, int threshold = 8);
 
 
     // TEMP
-    bool calcStereoDisparity(Image &otherImg, Image *disparityMap, unsigned int windowSize, unsigned int maxSearchD);
     void *calculateZNCC_thread(ZNCCArgs *args);
+    unsigned char znccDisparity(Image &otherImg, int x, int y, char windowSize, char dir, unsigned int maxSearchD);
 
     // helper methods
     void putPixel(unsigned int x, unsigned int y, Pixel pixel);
@@ -109,6 +141,13 @@ public:
     size_t sizeBytes();
     unsigned char grayAverage(unsigned int startX = 0, unsigned int startY = 0, size_t w = 0, size_t h = 0);
     bool validCoordinates(unsigned int x, unsigned int y);
+
+private:
+    bool allocateDevice();
+    void detachHost();
+    void fillNearest();
+    void fillEuclidean();
+    void medianHistogram(unsigned int radius);
 };
 
 /**
@@ -132,9 +171,9 @@ struct ZNCCArgs
     char dir;
     unsigned int maxSearchD;
     Image *thisImg;
-    Image otherImg;
+    Image *otherImg;
     Image *disparityMap;
 
-    ZNCCArgs(int tid, const char windowSize, unsigned int fromY, unsigned int toY, char dir, unsigned int maxSearchD, Image *thisImg, Image otherImg, Image *disparityMap)
+    ZNCCArgs(int tid, const char windowSize, unsigned int fromY, unsigned int toY, char dir, unsigned int maxSearchD, Image *thisImg, Image *otherImg, Image *disparityMap)
         : tid(tid), windowSize(windowSize), fromY(fromY), toY(toY), dir(dir), maxSearchD(maxSearchD), thisImg(thisImg), otherImg(otherImg), disparityMap(disparityMap) {}
 };
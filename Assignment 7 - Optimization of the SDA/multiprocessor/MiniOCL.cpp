@@ -3,13 +3,27 @@
 using std::cout;
 using std::endl;
 
+/**
+ * Returns the OpenCL handles of the (non-empty) events for a wait list.
+ */
+static std::vector<cl_event> eventHandles(const EventList &events)
+{
+    std::vector<cl_event> handles;
+
+    for (const Event &e : events)
+        if (e.get()) handles.push_back(e.get());
+
+    return handles;
+}
+
 /**
  * Initializes the object.
  * 
  * @param kernelFileName Name of the file that contains the kernel code.
  */
 MiniOCL::MiniOCL(const char* kernelFileName)
-    : kernelFileName(kernelFileName), device_type(), outImg(), outBuf(), platform(),
+    : kernelFileName(kernelFileName), device_type(), outputs(), scratch(), pooledBytes(0),
+      unifiedMemory(false), memAlignment(0), platform(),
       device_id(), context(), queue(), program(), kernel(), kernelEvent()
 {
     // initialize the object...
@@ -21,13 +35,23 @@ MiniOCL::MiniOCL(const char* kernelFileName)
 MiniOCL::~MiniOCL()
 {
     // release buffers
-    //clReleaseMemObject((cl_mem *)outImg);
+    if (scratch.buffer)
+        clReleaseMemObject(scratch.buffer);
 
-    clReleaseEvent(kernelEvent);
+    // release all pooled buffers, whether in use or not
+    for (auto &b : freeBuffers)
+        clReleaseMemObject(b.second);
+    for (auto &b : usedBuffers)
+        clReleaseMemObject(b.first);
 
     // release OpenCL resources
-    clReleaseKernel(kernel);
-    clReleaseProgram(program);
+    for (auto &k : kernels)
+        clReleaseKernel(k.second);
+
+    for (auto &v : variants)
+        clReleaseProgram(v.second);
+    if (program)
+        clReleaseProgram(program);
     clReleaseCommandQueue(queue);
     clReleaseContext(context);
  
@@ -41,8 +65,7 @@ MiniOCL::~MiniOCL()
 bool MiniOCL::initialize(cl_device_type device_type)
 {
     cl_int err = CL_SUCCESS;
-
-    this->device_type = device_type;
+    cl_device_id device_id = NULL;
 
     // bind to platform
     err |= clGetPlatformIDs(1, &platform, NULL);
@@ -50,6 +73,26 @@ bool MiniOCL::initialize(cl_device_type device_type)
     // get ID for the device (currently takes the first device automatically)
     err |= clGetDeviceIDs(platform, device_type, 1, &device_id, NULL);
 
+    if (err != CL_SUCCESS)
+        return false;
+
+    return this->initialize(device_id);
+}
+
+/**
+ * Initializes OpenCL on given device (of any platform).
+ * 
+ * @param device_id OpenCL device ID, e.g. from listDevices().
+ */
+bool MiniOCL::initialize(cl_device_id device_id)
+{
+    cl_int err = CL_SUCCESS;
+
+    this->device_id = device_id;
+
+    err |= clGetDeviceInfo(device_id, CL_DEVICE_PLATFORM, sizeof(platform), &platform, NULL);
+    err |= clGetDeviceInfo(device_id, CL_DEVICE_TYPE, sizeof(device_type), &device_type, NULL);
+
     if (err != CL_SUCCESS)
         return false;
  
@@ -63,231 +106,1133 @@ bool MiniOCL::initialize(cl_device_type device_type)
         0};
     queue = clCreateCommandQueueWithProperties(context, device_id, properties, &err);
 
+    if (err != CL_SUCCESS)
+        return false;
+
+    // devices sharing the memory with the host don't need to copy the data
+    cl_bool hostUnified = CL_FALSE;
+    cl_uint alignBits = 0;
+    clGetDeviceInfo(device_id, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(hostUnified), &hostUnified, NULL);
+    clGetDeviceInfo(device_id, CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(alignBits), &alignBits, NULL);
+    unifiedMemory = (hostUnified == CL_TRUE);
+    memAlignment = std::max((size_t)alignBits / 8, (size_t)1);
+
+    // read the kernel source from the file
+    std::ifstream kernelFile(kernelFileName);
+    source.assign(std::istreambuf_iterator<char>(kernelFile), (std::istreambuf_iterator<char>()));
+
+    // all the kernels are in the same file, so build them all at once
+    program = this->buildProgram("");
+
+    this->loadTuning();
+
+    return program != NULL;
+}
+
+/**
+ * Builds the program from the kernel source with given build options. This
+ * is done only once; the kernels are created from the program on demand.
+ * If a binary built from the same source and options for the same device and
+ * driver is found in the cache directory, it is used instead of compiling.
+ * 
+ * @param options Build options, e.g. "-DNAME=value".
+ * @return        The built program on success, NULL on fail.
+ */
+cl_program MiniOCL::buildProgram(const std::string &options)
+{
+    cl_int err = CL_SUCCESS;
+    const std::string cacheFile = this->cacheFileName(options);
+
+    // try the cached binary first
+    cl_program program = this->loadProgramBinary(cacheFile, options);
+    if (program)
+        return program;
+
+    // create the compute program from the source buffer
+    const char* sourceStr = source.c_str();
+    size_t sourceSizes[] = { source.size() };
+    program = clCreateProgramWithSource(context, 1, &sourceStr, sourceSizes, &err);
+
+    // build the program executable
+    err |= clBuildProgram(program, 1, &device_id, options.c_str(), NULL, NULL);
+
+    if (err != CL_SUCCESS)
+    {
+        // print the build log to see what went wrong
+        size_t logSize = 0;
+        clGetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_LOG, 0, NULL, &logSize);
+        std::vector<char> log(logSize + 1, '\0');
+        clGetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_LOG, logSize, log.data(), NULL);
+        cout << "Error building the OpenCL program:" << endl << log.data() << endl;
+
+        clReleaseProgram(program);
+        return NULL;
+    }
+
+    this->saveProgramBinary(program, cacheFile);
+
+    return program;
+}
+
+/**
+ * Returns the program binary cache file name for given build options.
+ * The name is a hash of everything that affects the built binary: the kernel
+ * source, the build options and the platform, device and driver versions.
+ * If any of them changes, the old binary is simply not found anymore.
+ * 
+ * @param options Build options.
+ * @return        Path of the cache file, or empty if caching is disabled.
+ */
+std::string MiniOCL::cacheFileName(const std::string &options)
+{
+    if (strlen(OCL_CACHE_DIR) == 0)
+        return "";
+
+    char platformVersion[512] = {0};
+    char deviceName[512] = {0};
+    char deviceVersion[512] = {0};
+    char driverVersion[512] = {0};
+
+    clGetPlatformInfo(platform, CL_PLATFORM_VERSION, sizeof(platformVersion), platformVersion, NULL);
+    clGetDeviceInfo(device_id, CL_DEVICE_NAME, sizeof(deviceName), deviceName, NULL);
+    clGetDeviceInfo(device_id, CL_DEVICE_VERSION, sizeof(deviceVersion), deviceVersion, NULL);
+    clGetDeviceInfo(device_id, CL_DRIVER_VERSION, sizeof(driverVersion), driverVersion, NULL);
+
+    const std::string parts[] = { source, options, platformVersion, deviceName, deviceVersion, driverVersion };
+
+    // 64-bit FNV-1a hash of all the parts (separated by a zero byte)
+    unsigned long long hash = 14695981039346656037ULL;
+    for (const std::string &part : parts)
+    {
+        for (size_t i = 0; i <= part.size(); i++)
+        {
+            hash ^= (unsigned char)part.c_str()[i];
+            hash *= 1099511628211ULL;
+        }
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.bin", hash);
+
+    return std::string(OCL_CACHE_DIR) + "/" + name;
+}
+
+/**
+ * Loads and builds a program from a cached binary.
+ * A binary that cannot be used is removed from the cache.
+ * 
+ * @param fileName Path of the cache file.
+ * @param options  Build options.
+ * @return         The built program on success, NULL if not cached or on fail.
+ */
+cl_program MiniOCL::loadProgramBinary(const std::string &fileName, const std::string &options)
+{
+    cl_int err = CL_SUCCESS;
+    cl_int binaryStatus = CL_SUCCESS;
+
+    if (fileName.empty())
+        return NULL;
+
+    std::ifstream file(fileName, std::ios::binary);
+    if (!file)
+        return NULL;
+
+    std::vector<unsigned char> binary(std::istreambuf_iterator<char>(file), (std::istreambuf_iterator<char>()));
+    file.close();
+
+    const unsigned char *binaryData = binary.data();
+    size_t binarySize = binary.size();
+
+    cl_program program = clCreateProgramWithBinary(context, 1, &device_id, &binarySize, &binaryData, &binaryStatus, &err);
+
+    if (err == CL_SUCCESS && binaryStatus == CL_SUCCESS)
+        err = clBuildProgram(program, 1, &device_id, options.c_str(), NULL, NULL);
+
+    if (err != CL_SUCCESS || binaryStatus != CL_SUCCESS)
+    {
+        cout << "Discarding unusable program binary '" << fileName << "'." << endl;
+
+        if (program)
+            clReleaseProgram(program);
+        remove(fileName.c_str());
+
+        return NULL;
+    }
+
+    return program;
+}
+
+/**
+ * Stores the binary of a built program to the cache.
+ * 
+ * @param program  The built program.
+ * @param fileName Path of the cache file.
+ * @return         True on success, false on fail.
+ */
+bool MiniOCL::saveProgramBinary(cl_program program, const std::string &fileName)
+{
+    cl_int err = CL_SUCCESS;
+
+    if (fileName.empty())
+        return false;
+
+    // the program is built for a single device, so there is a single binary
+    size_t binarySize = 0;
+    err |= clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &binarySize, NULL);
+
+    if (err != CL_SUCCESS || binarySize == 0)
+        return false;
+
+    std::vector<unsigned char> binary(binarySize);
+    unsigned char *binaryData = binary.data();
+    err |= clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(unsigned char *), &binaryData, NULL);
+
+    if (err != CL_SUCCESS)
+        return false;
+
+    // make sure that the cache directory exists (fails if it already does)
+#ifdef _WIN32
+    _mkdir(OCL_CACHE_DIR);
+#else
+    mkdir(OCL_CACHE_DIR, 0755);
+#endif
+
+    std::ofstream file(fileName, std::ios::binary);
+    file.write((const char *)binaryData, binarySize);
+
+    return file.good();
+}
+
+/**
+ * Selects the kernel to be used. Each kernel is created only once from the
+ * already built program and cached by name, so switching between kernels
+ * is cheap. The kernel arguments have to be set after this.
+ * 
+ * A variant of the kernel specialized for some parameters can be selected
+ * with build options (e.g. "-DWINDOW_SIZE=9"). The program is built once per
+ * set of options, and the binary is cached on disk like the default one.
+ * 
+ * @param kernelName Name of the kernel function to be used.
+ * @param options    Build options of the variant ("" = the default program).
+ * @return           True on success, false on fail.
+ */
+bool MiniOCL::useKernel(const char *kernelName, const std::string &options /* = "" */)
+{
+    cl_int err = CL_SUCCESS;
+
+    // buffers bound to a kernel that was never executed
+    this->recycleKernelBuffers();
+
+    // variants are cached (and tuned) separately
+    const std::string name = options.empty() ? std::string(kernelName) : std::string(kernelName) + " " + options;
+    auto cached = kernels.find(name);
+
+    if (cached != kernels.end())
+    {
+        kernel = cached->second;
+    } else {
+        cl_program variant = program;
+
+        if (!options.empty())
+        {
+            auto built = variants.find(options);
+
+            if (built != variants.end()) {
+                variant = built->second;
+            } else {
+                variant = this->buildProgram(options);
+
+                if (!variant)
+                    return false;
+
+                variants[options] = variant;
+            }
+        }
+
+        // create the compute kernel in the program we wish to run
+        kernel = clCreateKernel(variant, kernelName, &err);
+
+        if (err != CL_SUCCESS)
+            return false;
+
+        kernels[name] = kernel;
+    }
+
+    this->kernelName = kernelName;
+    this->kernelOptions = options;
+    outputs.clear();
+
+    return true;
+}
+
+/**
+ * Executes the initialized and built kernel and waits for it to finish.
+ * The output (if any) has been read back to the host when this returns.
+ * 
+ * @param globalWidth   Global width of the image.
+ * @param globalHeight  Global height of the image.
+ * @param localWidth    Local width of the image (OCL_LOCAL_AUTO = autotuned).
+ * @param localHeight   Local width of the image (OCL_LOCAL_AUTO = autotuned).
+ * 
+ * @return              True on success, false on fail.
+ */
+bool MiniOCL::executeKernel(size_t globalWidth, size_t globalHeight, size_t localWidth, size_t localHeight)
+{
+    Event done;
+
+    bool success = this->enqueueKernel(globalWidth, globalHeight, localWidth, localHeight, &done);
+
+    return done.wait() && success;
+}
+
+/**
+ * Enqueues the initialized and built kernel without waiting for it. The
+ * outputs set with setOutput*Buffer() are read back according to their
+ * policies; the host memory of asynchronous outputs must not be touched
+ * before @done has completed. Commands run in order, so kernels using the
+ * results of earlier ones can simply be enqueued after them.
+ * 
+ * NOTE: With OCL_LOCAL_AUTO, the first launch of a kernel for a size class
+ * that is not in the tuning table blocks until the local size has been tuned
+ * (see tuneLocalSize). Later launches, and runs with a tuning file, do not.
+ * The tuning runs the kernel with its real arguments, so OCL_LOCAL_AUTO may
+ * only be used with kernels that can be run again with the same result, i.e.
+ * that do not write their inputs (in place) or accumulate to their outputs.
+ * 
+ * @param globalWidth   Global width of the image.
+ * @param globalHeight  Global height of the image.
+ * @param localWidth    Local width of the image (OCL_LOCAL_AUTO = autotuned).
+ * @param localHeight   Local width of the image (OCL_LOCAL_AUTO = autotuned).
+ * @param done          If given, set to the event of the kernel (or of the last read).
+ * @param waitList      Events that must complete before the kernel starts.
+ * 
+ * @return              True on success, false on fail.
+ */
+bool MiniOCL::enqueueKernel(size_t globalWidth, size_t globalHeight, size_t localWidth, size_t localHeight,
+                            Event *done /* = NULL */, const EventList &waitList /* = EventList() */)
+{
+    cl_int err = CL_SUCCESS;
+    cl_event event = NULL;
+
+    const std::vector<cl_event> events = eventHandles(waitList);
+
+    if (localWidth == OCL_LOCAL_AUTO || localHeight == OCL_LOCAL_AUTO)
+        this->tuneLocalSize(globalWidth, globalHeight, events, localWidth, localHeight);
+
+    // Execute the kernel over the entire range of the data set
+    err = this->launch(globalWidth, globalHeight, localWidth, localHeight, events, &event);
+
+    kernelEvent = Event(err == CL_SUCCESS ? event : NULL);
+    Event last = kernelEvent;
+
+    // kernels that only write to device buffers have nothing to read
+    if (err == CL_SUCCESS && !outputs.empty())
+    {
+        cl_event readEvent = NULL;
+        err = this->readOutputs(&readEvent) ? CL_SUCCESS : CL_INVALID_VALUE;
+
+        if (readEvent)
+            last = Event(readEvent);
+    }
+
+    if (done)
+        *done = last;
+
+    // the queue is in order, so the buffers can be reused by the next kernel
+    this->recycleKernelBuffers();
+    outputs.clear();
+
+    return err == CL_SUCCESS;
+}
+
+/**
+ * Enqueues the current kernel. The global size is rounded up to a multiple
+ * of the local size, so the kernels must check their bounds.
+ * 
+ * @param globalWidth   Global width of the image.
+ * @param globalHeight  Global height of the image.
+ * @param localWidth    Local width.
+ * @param localHeight   Local height.
+ * @param waitList      Events that must complete before the kernel starts.
+ * @param event         Set to the event of the kernel.
+ * @return              OpenCL error code.
+ */
+cl_int MiniOCL::launch(size_t globalWidth, size_t globalHeight, size_t localWidth, size_t localHeight,
+                       const std::vector<cl_event> &waitList, cl_event *event)
+{
+    const size_t localWorkSize[2] = { localWidth, localHeight };
+    const size_t globalWorkSize[2] = {
+        (globalWidth + localWidth - 1) / localWidth * localWidth,
+        (globalHeight + localHeight - 1) / localHeight * localHeight };
+
+    cl_int err = clEnqueueNDRangeKernel(queue, kernel, 2, NULL, globalWorkSize, localWorkSize,
+                                        (cl_uint)waitList.size(), waitList.empty() ? NULL : waitList.data(), event);
+
+    if (err == CL_SUCCESS)
+        this->profile(OCL_CMD_KERNEL, *event);
+
+    return err;
+}
+
+/**
+ * Picks the local size for the current kernel and global size. The best size
+ * is looked up from the tuning table. If there is none yet, each candidate
+ * that the kernel supports on the device is timed, and the fastest is stored
+ * in the table (and the tuning file) for later runs. The kernel arguments must
+ * already be set; the candidates are run on a band of at most 64 rows from the
+ * middle of the range (with a global offset), so a trial costs a fraction of a
+ * launch. The trials are waited for, so tuning blocks the caller (once per
+ * kernel, variant and size class); it stops early once the trials have taken
+ * longer than the budget, and they are not included in the profile.
+ * 
+ * NOTE: The trials write to the real outputs, which the launch then writes
+ * again. The kernel must not write its inputs or accumulate to its outputs
+ * (see enqueueKernel).
+ * 
+ * @param globalWidth   Global width of the image.
+ * @param globalHeight  Global height of the image.
+ * @param waitList      Events that must complete before the kernel starts.
+ * @param localWidth    Set to the local width.
+ * @param localHeight   Set to the local height.
+ */
+void MiniOCL::tuneLocalSize(size_t globalWidth, size_t globalHeight, const std::vector<cl_event> &waitList,
+                            size_t &localWidth, size_t &localHeight)
+{
+    // the first supported one is used when not tuning
+    static const size_t candidates[][2] = {
+        { 16, 16 }, { 8, 8 }, { 16, 8 }, { 32, 8 }, { 8, 32 }, { 32, 4 }, { 64, 4 }, { 32, 16 }, { 4, 4 },
+        { 16, 1 }, { 32, 1 }, { 64, 1 }, { 128, 1 }, { 256, 1 }
+    };
+    const int runs = 2;                 // the fastest of the runs counts
+    const size_t bandRows = 64;         // a multiple of all the candidate heights
+    const double budget = 50e6;         // total device time of the trials (ns)
+
+    const std::string key = this->tuningKey(globalWidth, globalHeight);
+    auto known = tuning.find(key);
+
+    if (known != tuning.end())
+    {
+        localWidth = known->second.first;
+        localHeight = known->second.second;
+        return;
+    }
+
+    std::vector<std::pair<size_t, size_t>> supported;
+    for (const size_t *c : candidates)
+    {
+        if (!this->supportsLocalSize(c[0], c[1]))
+            continue;
+
+        // e.g. a single row is not run in 16 rows high groups
+        if ((c[0] > 1 && c[0] > globalWidth) || (c[1] > 1 && c[1] > globalHeight))
+            continue;
+
+        supported.push_back(std::make_pair(c[0], c[1]));
+    }
+
+    std::pair<size_t, size_t> best(1, 1);
+
+    if (!supported.empty())
+        best = supported.front();
+
+    if (strlen(OCL_TUNING_FILE) == 0 || supported.size() < 2)
+    {
+        localWidth = best.first;
+        localHeight = best.second;
+        return;
+    }
+
+    cout << "Tuning the local size of " << kernelName << (kernelOptions.empty() ? "" : " " + kernelOptions) << "... ";
+    double bestTime = -1.0;
+    double spent = 0.0;
+
+    // the same band of rows for all the candidates, away from the edges
+    const size_t trialHeight = std::min(globalHeight, bandRows);
+    const size_t trialOffset = (globalHeight - trialHeight) / 2 / bandRows * bandRows;
+
+    for (const std::pair<size_t, size_t> &size : supported)
+    {
+        double time = -1.0;
+
+        for (int run = 0; run < runs; run++)
+        {
+            // not through launch(), so the trial runs are not in the stage profiles
+            const size_t localWorkSize[2] = { size.first, size.second };
+            const size_t globalWorkOffset[2] = { 0, trialOffset };
+            const size_t globalWorkSize[2] = {
+                (globalWidth + size.first - 1) / size.first * size.first,
+                (trialHeight + size.second - 1) / size.second * size.second };
+            cl_event event = NULL;
+
+            if (clEnqueueNDRangeKernel(queue, kernel, 2, globalWorkOffset, globalWorkSize, localWorkSize,
+                                       (cl_uint)waitList.size(), waitList.empty() ? NULL : waitList.data(),
+                                       &event) != CL_SUCCESS)
+            {
+                time = -1.0;
+                break;
+            }
+
+            Event done(event);
+            done.wait();
+
+            cl_ulong start = 0, end = 0;
+            clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL);
+            clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL);
+
+            spent += (double)(end - start);
+            if (time < 0.0 || end - start < time)
+                time = (double)(end - start);
+        }
+
+        if (time >= 0.0 && (bestTime < 0.0 || time < bestTime))
+        {
+            bestTime = time;
+            best = size;
+        }
+
+        // long kernels are tuned only over the first candidates
+        if (spent > budget)
+            break;
+    }
+
+    cout << best.first << "x" << best.second << "." << endl;
+
+    tuning[key] = best;
+    this->saveTuning();
+
+    localWidth = best.first;
+    localHeight = best.second;
+}
+
+/**
+ * Returns the key of the tuning table for the current device, kernel (and the
+ * build options of its variant) and global size. Global sizes are classified
+ * by rounding them up to powers of two, so similar image sizes share the
+ * tuned local size. Specialized variants (see useKernel) are tuned separately.
+ * 
+ * @param globalWidth   Global width of the image.
+ * @param globalHeight  Global height of the image.
+ * @return              The key (tab separated).
+ */
+std::string MiniOCL::tuningKey(size_t globalWidth, size_t globalHeight)
+{
+    size_t widthClass = 1, heightClass = 1;
+    while (widthClass < globalWidth) widthClass *= 2;
+    while (heightClass < globalHeight) heightClass *= 2;
+
+    return deviceDescription + "\t" + kernelName + "\t" + kernelOptions + "\t" +
+           std::to_string(widthClass) + "x" + std::to_string(heightClass);
+}
+
+/**
+ * Loads the tuning table from OCL_TUNING_FILE. Each line is a key (device,
+ * kernel, build options and size class) followed by the local width and
+ * height, separated by tabs. Entries of other devices are kept, so the file
+ * can be shared.
+ */
+void MiniOCL::loadTuning()
+{
+    char deviceName[512] = {0};
+    char driverVersion[512] = {0};
+
+    clGetDeviceInfo(device_id, CL_DEVICE_NAME, sizeof(deviceName), deviceName, NULL);
+    clGetDeviceInfo(device_id, CL_DRIVER_VERSION, sizeof(driverVersion), driverVersion, NULL);
+    deviceDescription = std::string(deviceName) + " / " + driverVersion;
+
+    if (strlen(OCL_TUNING_FILE) == 0)
+        return;
+
+    std::ifstream file(OCL_TUNING_FILE);
+    std::string line;
+
+    while (std::getline(file, line))
+    {
+        const size_t heightPos = line.rfind('\t');
+        const size_t widthPos = heightPos == std::string::npos || heightPos == 0
+            ? std::string::npos : line.rfind('\t', heightPos - 1);
+
+        if (widthPos == std::string::npos)
+            continue;
+
+        const size_t localWidth = strtoul(line.c_str() + widthPos + 1, NULL, 10);
+        const size_t localHeight = strtoul(line.c_str() + heightPos + 1, NULL, 10);
+
+        if (localWidth > 0 && localHeight > 0)
+            tuning[line.substr(0, widthPos)] = std::make_pair(localWidth, localHeight);
+    }
+}
+
+/**
+ * Stores the whole tuning table to OCL_TUNING_FILE.
+ * 
+ * @return True on success, false on fail.
+ */
+bool MiniOCL::saveTuning()
+{
+    // other instances (e.g. on other devices) may have stored entries meanwhile
+    const std::map<std::string, std::pair<size_t, size_t>> own = tuning;
+    this->loadTuning();
+    for (auto &entry : own)
+        tuning[entry.first] = entry.second;
+
+    std::ofstream file(OCL_TUNING_FILE);
+
+    for (auto &entry : tuning)
+        file << entry.first << '\t' << entry.second.first << '\t' << entry.second.second << '\n';
+
+    return file.good();
+}
+
+/**
+ * Waits until all the enqueued commands have finished.
+ * 
+ * @return True on success, false on fail.
+ */
+bool MiniOCL::finish()
+{
+    return clFinish(queue) == CL_SUCCESS;
+}
+
+/**
+ * Enqueues the reads of the kernel outputs to their host addresses, each
+ * according to its read-back policy. The queue is in order, so the event of
+ * the last read completes after all of them.
+ * 
+ * @param event Set to the event of the last read (NULL if nothing was read).
+ * @return      True on success, false on fail.
+ */
+bool MiniOCL::readOutputs(cl_event *event)
+{
+    cl_int err = CL_SUCCESS;
+
+    for (auto &out : outputs)
+    {
+        if (out.policy == OCL_READ_NONE)
+            continue;
+
+        const cl_bool blocking = (out.policy == OCL_READ_BLOCKING) ? CL_TRUE : CL_FALSE;
+
+        if (*event)
+            clReleaseEvent(*event);
+        *event = NULL;
+
+        if (out.isImage)
+        {
+            err |= clEnqueueReadImage(queue,
+                out.buffer, blocking,
+                out.origin,
+                out.region, 0, 0,
+                out.data, 0, NULL, event);
+        } else {
+            err |= clEnqueueReadBuffer(queue,
+                out.buffer, blocking, 0,
+                out.size,
+                out.data, 0, NULL, event);
+        }
+
+        this->profile(OCL_CMD_TRANSFER, *event);
+    }
+
+    return err == CL_SUCCESS;
+}
+
+/**
+ * Sets a simple value as a kernel argument.
+ * 
+ * @param argIndex Argument index.
+ * @param value    Pointer to the value to be bound to the argument.
+ * @param size     Value data size in bytes.
+ * @return         True on success, false on fail.
+ */
+bool MiniOCL::setValue(cl_uint argIndex, void *value, size_t size)
+{
+    cl_int err = CL_SUCCESS;
+
+    err = clSetKernelArg(kernel, argIndex, size, value);
+
+    return err == CL_SUCCESS;
+}
+
+/**
+ * Sets an input buffer as a kernel argument. The data is uploaded to a
+ * pooled buffer, which goes back to the pool once the kernel has been executed.
+ * 
+ * @param argIndex Argument index.
+ * @param data     Pointer to the buffer to be bound to the argument.
+ * @param size     Buffer size in bytes.
+ * @return         True on success, false on fail.
+ */
+bool MiniOCL::setInputBuffer(cl_uint argIndex, void *data, size_t size)
+{
+    cl_int err = CL_SUCCESS;
+
+    const buffer_key_t key = { size, 0, 0, 0, 0, CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY };
+    cl_mem buffer = this->acquireBuffer(key);
+
+    if (!buffer)
+        return false;
+
+    kernelBuffers.push_back(buffer);
+
+    cl_event event = NULL;
+    err |= clEnqueueWriteBuffer(queue, buffer, CL_TRUE, 0, size, data, 0, NULL, &event);
+    this->profile(OCL_CMD_TRANSFER, event);
+    Event written(event);
+
+    err |= clSetKernelArg(kernel, argIndex, sizeof(cl_mem), &buffer);
+
+    return err == CL_SUCCESS;
+}
+
+/**
+ * Sets an output buffer as a kernel argument. A kernel can have any number
+ * of outputs, and each of them is read back according to its own policy.
+ * 
+ * @param argIndex Argument index.
+ * @param data     Pointer to the buffer to be bound to the argument.
+ * @param size     Buffer size in bytes.
+ * @param policy   How the output is read back after the kernel.
+ * @return         True on success, false on fail.
+ */
+bool MiniOCL::setOutputBuffer(cl_uint argIndex, void *data, size_t size, read_policy_t policy /* = OCL_READ_ASYNC */)
+{
+    cl_int err = CL_SUCCESS;
+
+    // results that are not read back are never accessed by the host
+    const cl_mem_flags hostFlags = (policy == OCL_READ_NONE) ? CL_MEM_HOST_NO_ACCESS : CL_MEM_HOST_READ_ONLY;
+    const buffer_key_t key = { size, 0, 0, 0, 0, CL_MEM_WRITE_ONLY | hostFlags };
+
+    output_t out = output_t();
+    out.buffer = this->acquireBuffer(key);
+    out.data = data;
+    out.isImage = false;
+    out.size = size;
+    out.policy = policy;
+
+    if (!out.buffer)
+        return false;
+
+    kernelBuffers.push_back(out.buffer);
+    outputs.push_back(out);
+
+    err |= clSetKernelArg(kernel, argIndex, sizeof(cl_mem), &out.buffer);
+
+    return err == CL_SUCCESS;
+}
+
+/**
+ * Sets the scratch buffer as a kernel argument. The scratch buffer lives only
+ * on the device and is kept between kernels, so one kernel can write it
+ * and the next one read it without transferring the data to the host.
+ * It is reallocated only if it is too small.
+ * 
+ * @param argIndex Argument index.
+ * @param size     Required buffer size in bytes.
+ * @return         True on success, false on fail.
+ */
+bool MiniOCL::setScratchBuffer(cl_uint argIndex, size_t size)
+{
+    cl_int err = CL_SUCCESS;
+
+    if (!scratch.buffer || scratch.size < size)
+    {
+        if (scratch.buffer)
+            clReleaseMemObject(scratch.buffer);
+
+        cl_mem_flags flags = CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS;
+        scratch.buffer = clCreateBuffer(context, flags, size, NULL, &err);
+        scratch.size = size;
+    }
+
+    err |= clSetKernelArg(kernel, argIndex, sizeof(cl_mem), &scratch.buffer);
+
+    return err == CL_SUCCESS;
+}
+
+/**
+ * Allocates a local memory buffer (shared by a work-group) as a kernel argument.
+ * 
+ * @param argIndex Argument index.
+ * @param size     Buffer size in bytes per work-group.
+ * @return         True on success, false on fail.
+ */
+bool MiniOCL::setLocalBuffer(cl_uint argIndex, size_t size)
+{
+    cl_int err = CL_SUCCESS;
+
+    err = clSetKernelArg(kernel, argIndex, size, NULL);
+
+    return err == CL_SUCCESS;
+}
+
+/**
+ * Sets an input image buffer as a kernel argument.
+ * 
+ * @param argIndex      Argument index.
+ * @param data          Pointer to the image to be bound to the argument.
+ * @param width         Image width.
+ * @param height        Image height.
+ * @param singleChannel Whether a single channel image is in use.
+ * @return              True on success, false on fail.
+ */
+bool MiniOCL::setInputImageBuffer(cl_uint argIndex, void* data, size_t width, size_t height, bool singleChannel)
+{
+    cl_int err = CL_SUCCESS;
+
+    if (singleChannel)
+        return setInputBuffer(argIndex, data, width * height * sizeof(unsigned char));
+
+    cl_mem buffer = this->acquireImage(width, height, CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY);
+
+    if (!buffer)
+        return false;
+
+    kernelBuffers.push_back(buffer);
+
+    const size_t origin[3] = { 0, 0, 0 };
+    const size_t region[3] = { width, height, 1 };
+
+    cl_event event = NULL;
+    err |= clEnqueueWriteImage(queue, buffer, CL_TRUE, origin, region, 0, 0, data, 0, NULL, &event);
+    this->profile(OCL_CMD_TRANSFER, event);
+    Event written(event);
+
+    // set the arguments to the kernel
+    err |= clSetKernelArg(kernel, argIndex, sizeof(cl_mem), &buffer);
+
+    return err == CL_SUCCESS;
+}
+
+/**
+ * Sets an output image buffer as a kernel argument.
+ * 
+ * @param argIndex      Argument index.
+ * @param data          Pointer to the image to be bound to the argument.
+ * @param width         Image width.
+ * @param height        Image height.
+ * @param singleChannel Whether a single channel image is in use.
+ * @param policy        How the output is read back after the kernel.
+ * @return              True on success, false on fail.
+ */
+bool MiniOCL::setOutputImageBuffer(cl_uint argIndex, void *data, size_t width, size_t height, bool singleChannel,
+                                   read_policy_t policy /* = OCL_READ_ASYNC */)
+{
+    cl_int err = CL_SUCCESS;
+
+    if (singleChannel)
+        return setOutputBuffer(argIndex, data, width * height * sizeof(unsigned char), policy);
+
+    size_t origin[3] = { 0, 0, 0 };
+    size_t region[3] = { width, height, 1 };
+
+    const cl_mem_flags hostFlags = (policy == OCL_READ_NONE) ? CL_MEM_HOST_NO_ACCESS : CL_MEM_HOST_READ_ONLY;
+
+    output_t out = output_t();
+    out.buffer = this->acquireImage(width, height, CL_MEM_WRITE_ONLY | hostFlags);
+    out.data = data;
+    out.isImage = true;
+    out.policy = policy;
+
+    if (!out.buffer)
+        return false;
+
+    kernelBuffers.push_back(out.buffer);
+
+    // set the image origin and region
+    std::copy(origin, origin + 3, out.origin);
+    std::copy(region, region + 3, out.region);
+
+    outputs.push_back(out);
+
+    err |= clSetKernelArg(kernel, argIndex, sizeof(cl_mem), &out.buffer);
+
     return err == CL_SUCCESS;
 }
 
 /**
- * Reads the kernel source code from a file and builds the kernel.
- * 
- * @param kernelName Name of the kernel function to be used.
+ * Returns a buffer matching the key from the pool, or creates a new one if
+ * there is none. The buffer is then in use until released with releaseBuffer().
+ *
+ * @param key Description of the buffer.
+ * @return    The buffer on success, NULL on fail.
  */
-bool MiniOCL::buildKernel(const char *kernelName)
+cl_mem MiniOCL::acquireBuffer(const buffer_key_t &key)
 {
     cl_int err = CL_SUCCESS;
+    cl_mem buffer;
 
-    // read the kernel source from the file
-    std::ifstream kernelFile(kernelFileName);
-    std::string source(std::istreambuf_iterator<char>(kernelFile), (std::istreambuf_iterator<char>()));
+    auto pooled = freeBuffers.find(key);
 
-    // create the compute program from the source buffer
-    const char* sourceStr = source.c_str();
-    size_t sourceSizes[] = { strlen(sourceStr) };
-    program = clCreateProgramWithSource(context, 1, &sourceStr, sourceSizes, &err);
+    if (pooled != freeBuffers.end())
+    {
+        buffer = pooled->second;
+        pooledBytes -= key.size;
+        freeBuffers.erase(pooled);
+    } else if (key.width > 0) {
+        const cl_image_format format = { key.order, key.type };
+        const cl_image_desc description = {
+            CL_MEM_OBJECT_IMAGE2D, key.width, key.height, 0, 0, 0, 0, 0, 0, NULL
+        };
 
-    // build the program executable
-    err |= clBuildProgram(program, 1, &device_id, NULL, NULL, NULL);
+        buffer = clCreateImage(context, key.flags, &format, &description, NULL, &err);
+    } else {
+        buffer = clCreateBuffer(context, key.flags, key.size, NULL, &err);
+    }
+
+    if (err != CL_SUCCESS)
+        return NULL;
 
-    // create the compute kernel in the program we wish to run
-    kernel = clCreateKernel(program, kernelName, &err);
+    usedBuffers[buffer] = key;
 
-    return err == CL_SUCCESS;
+    return buffer;
 }
 
 /**
- * Executes the initialized and built kernel.
- * 
- * @param globalWidth   Global width of the image.
- * @param globalHeight  Global height of the image.
- * @param localWidth    Local width of the image.
- * @param localHeight   Local width of the image.
- * 
- * @return              True on success, false on fail.
+ * Returns a pooled RGBA image buffer (each channel is an unsigned 8-bit integer).
+ *
+ * @param width  Image width.
+ * @param height Image height.
+ * @param flags  Memory flags.
+ * @return       The image buffer on success, NULL on fail.
  */
-bool MiniOCL::executeKernel(size_t globalWidth, size_t globalHeight, size_t localWidth, size_t localHeight)
+cl_mem MiniOCL::acquireImage(size_t width, size_t height, cl_mem_flags flags)
 {
-    cl_int err = CL_SUCCESS;
-
-    // set work sizes (based on local work size)
-    const size_t localWorkSize[2] = { localWidth, localHeight };
-    const size_t globalWorkSize[2] = {
-        (size_t)ceil(globalWidth/(float)localWorkSize[0]) * localWorkSize[0],
-        (size_t)ceil(globalHeight/(float)localWorkSize[1]) * localWorkSize[1]};
+    const buffer_key_t key = { width * height * 4, width, height, CL_RGBA, CL_UNORM_INT8, flags };
 
-    // Execute the kernel over the entire range of the data set
-    err = clEnqueueNDRangeKernel(queue, kernel, 2, NULL, globalWorkSize, localWorkSize,
-                                 0, NULL, &kernelEvent);
+    return this->acquireBuffer(key);
+}
 
-    // wait for the kernel to finish
-    clWaitForEvents(1, &kernelEvent);
- 
-    // wait for the command queue to get serviced before reading back results
-    clFinish(queue);
-    this->readOutput();
+/**
+ * Returns the buffers bound by the set*Buffer() calls back to the pool.
+ */
+void MiniOCL::recycleKernelBuffers()
+{
+    for (cl_mem buffer : kernelBuffers)
+        this->releaseBuffer(buffer);
 
-    return err == CL_SUCCESS;
+    kernelBuffers.clear();
 }
 
 /**
- * Reads the computing output from the OpenCL kernel
- * and stores it to the output address.
- * 
- * @return True on success, false on fail.
+ * Returns a device buffer that is not tied to any kernel argument. The caller
+ * owns the buffer and must release it with releaseBuffer().
+ *
+ * @param size Buffer size in bytes.
+ * @return     The buffer on success, NULL on fail.
  */
-bool MiniOCL::readOutput()
+cl_mem MiniOCL::createBuffer(size_t size)
 {
-    cl_int err = CL_SUCCESS;
-
-    if (outputIsImage)
-    {
-        err |= clEnqueueReadImage(queue,
-            outImg.buffer, CL_TRUE,
-            outImg.origin,
-            outImg.region, 0, 0,
-            outImg.data, 0, NULL, NULL);
-    } else {
-        err |= clEnqueueReadBuffer(queue,
-            outBuf.buffer, CL_TRUE, 0,
-            outBuf.size,
-            outBuf.data, 0, NULL, NULL);
-    }
+    // host accessible memory can be mapped instead of copied
+    const cl_mem_flags flags = unifiedMemory ? CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR : CL_MEM_READ_WRITE;
+    const buffer_key_t key = { size, 0, 0, 0, 0, flags };
 
-    return err == CL_SUCCESS;
+    return this->acquireBuffer(key);
 }
 
 /**
- * Sets a simple value as a kernel argument.
- * 
- * @param argIndex Argument index.
- * @param value    Pointer to the value to be bound to the argument.
- * @param size     Value data size in bytes.
- * @return         True on success, false on fail.
+ * Returns a buffer back to the pool for reuse. If the pool is full (see
+ * OCL_POOL_LIMIT) or the buffer is not from the pool, it is freed instead.
+ *
+ * @param buffer The buffer to be released.
  */
-bool MiniOCL::setValue(cl_uint argIndex, void *value, size_t size)
+void MiniOCL::releaseBuffer(cl_mem buffer)
 {
-    cl_int err = CL_SUCCESS;
+    if (!buffer)
+        return;
 
-    err = clSetKernelArg(kernel, argIndex, size, value);
+    auto used = usedBuffers.find(buffer);
 
-    return err == CL_SUCCESS;
+    if (used == usedBuffers.end())
+    {
+        clReleaseMemObject(buffer);
+        return;
+    }
+
+    const buffer_key_t key = used->second;
+    usedBuffers.erase(used);
+
+    if (pooledBytes + key.size > OCL_POOL_LIMIT)
+    {
+        clReleaseMemObject(buffer);
+        return;
+    }
+
+    freeBuffers.insert(std::make_pair(key, buffer));
+    pooledBytes += key.size;
 }
 
 /**
- * Sets an input buffer as a kernel argument.
- * 
+ * Sets an existing device buffer as a kernel argument.
+ * Nothing is transferred to or from the host.
+ *
  * @param argIndex Argument index.
- * @param data     Pointer to the buffer to be bound to the argument.
- * @param size     Buffer size in bytes.
+ * @param buffer   The buffer to be bound to the argument.
  * @return         True on success, false on fail.
  */
-bool MiniOCL::setInputBuffer(cl_uint argIndex, void *data, size_t size)
+bool MiniOCL::setBuffer(cl_uint argIndex, cl_mem buffer)
 {
     cl_int err = CL_SUCCESS;
 
-    cl_mem_flags flags = CL_MEM_READ_ONLY | CL_MEM_HOST_NO_ACCESS | CL_MEM_COPY_HOST_PTR;
-    cl_mem buffer = clCreateBuffer(context, flags, size, data, &err);
-    //buffers.push_back( clCreateBuffer(context, flags, size, data, &err) );
+    if (!buffer)
+        return false;
 
-    err |= clSetKernelArg(kernel, argIndex, sizeof(cl_mem), &buffer);
-    // this->setValue(argIndex, (void *)&buffer, sizeof(cl_mem));
+    err = clSetKernelArg(kernel, argIndex, sizeof(cl_mem), &buffer);
 
     return err == CL_SUCCESS;
 }
 
 /**
- * Sets an output buffer as a kernel argument.
- * 
- * @param argIndex Argument index.
- * @param data     Pointer to the buffer to be bound to the argument.
- * @param size     Buffer size in bytes.
- * @return         True on success, false on fail.
+ * Returns a buffer that uses given host memory directly (zero-copy), if the
+ * device shares the memory with the host and the memory is suitably aligned.
+ * The buffer is not pooled. The contents are those of the host memory when
+ * the buffer is created; after that, the host memory must only be accessed
+ * through enqueueRead() and enqueueWrite() until the buffer is released.
+ *
+ * @param data Pointer to the host memory.
+ * @param size Size in bytes.
+ * @return     The buffer, or NULL if the memory cannot be wrapped.
  */
-bool MiniOCL::setOutputBuffer(cl_uint argIndex, void *data, size_t size)
+cl_mem MiniOCL::wrapHostMemory(void *data, size_t size)
 {
     cl_int err = CL_SUCCESS;
 
-    outputIsImage = false;
+    if (!unifiedMemory || size == 0 || (uintptr_t)data % memAlignment != 0)
+        return NULL;
 
-    cl_mem_flags flags = CL_MEM_WRITE_ONLY;
-    outBuf.buffer = clCreateBuffer(context, flags, size, NULL, &err);
-    outBuf.size = size;
-    outBuf.data = data;
+    cl_mem buffer = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, size, data, &err);
 
-    err |= clSetKernelArg(kernel, argIndex, sizeof(cl_mem), &outBuf.buffer);
+    return err == CL_SUCCESS ? buffer : NULL;
+}
 
-    return err == CL_SUCCESS;
+/**
+ * Returns true if the device shares the memory with the host
+ * (CL_DEVICE_HOST_UNIFIED_MEMORY), so data is mapped instead of copied.
+ */
+bool MiniOCL::hasUnifiedMemory()
+{
+    return unifiedMemory;
 }
 
 /**
- * Sets an input image buffer as a kernel argument.
- * 
- * @param argIndex      Argument index.
- * @param data          Pointer to the image to be bound to the argument.
- * @param width         Image width.
- * @param height        Image height.
- * @param singleChannel Whether a single channel image is in use.
- * @return              True on success, false on fail.
+ * Enqueues a non-blocking copy from the host to a device buffer.
+ * The host data must not be modified or freed before @done has completed.
+ * On devices with unified memory, the buffer is mapped and written directly
+ * instead (this blocks, but there is no transfer to wait for).
+ *
+ * @param buffer   The device buffer.
+ * @param data     Pointer to the host data.
+ * @param size     Data size in bytes.
+ * @param done     If given, set to the event of the copy.
+ * @param waitList Events that must complete before the copy starts.
+ * @return         True on success, false on fail.
  */
-bool MiniOCL::setInputImageBuffer(cl_uint argIndex, void* data, size_t width, size_t height, bool singleChannel)
+bool MiniOCL::enqueueWrite(cl_mem buffer, const void *data, size_t size,
+                           Event *done /* = NULL */, const EventList &waitList /* = EventList() */)
 {
     cl_int err = CL_SUCCESS;
+    cl_event event = NULL;
 
-    if (singleChannel)
-        return setInputBuffer(argIndex, data, width * height * sizeof(unsigned char));
+    const std::vector<cl_event> events = eventHandles(waitList);
 
-    // Pixel format: RGBA, each pixel channel is unsigned 8-bit integer
-    static const cl_image_format format = { CL_RGBA, CL_UNORM_INT8 };
+    if (unifiedMemory)
+    {
+        cl_event mapEvent = NULL;
+        void *mapped = clEnqueueMapBuffer(queue, buffer, CL_TRUE, CL_MAP_WRITE_INVALIDATE_REGION, 0, size,
+                                          (cl_uint)events.size(), events.empty() ? NULL : events.data(), &mapEvent, &err);
+        this->profile(OCL_CMD_TRANSFER, mapEvent);
+        Event mapDone(mapEvent);
 
-    const cl_image_desc description = {
-        CL_MEM_OBJECT_IMAGE2D, width, height, 0, 0, 0, 0, 0, 0, NULL
-    };
+        if (err == CL_SUCCESS)
+        {
+            // a wrapped buffer is mapped to the host memory itself
+            if (mapped != data)
+                memcpy(mapped, data, size);
+
+            err = clEnqueueUnmapMemObject(queue, buffer, mapped, 0, NULL, &event);
+        }
+    } else {
+        err = clEnqueueWriteBuffer(queue, buffer, CL_FALSE, 0, size, data,
+                                   (cl_uint)events.size(), events.empty() ? NULL : events.data(), &event);
+    }
+
+    if (err == CL_SUCCESS)
+        this->profile(OCL_CMD_TRANSFER, event);
+
+    Event written(err == CL_SUCCESS ? event : NULL);
+    if (done)
+        *done = written;
 
-    cl_mem_flags flags = CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR;
-    // cl_mem buffer = clCreateImage(context, flags, &format, &description, data, &err);
-    cl_mem buffer = clCreateImage(context, flags, &format, &description, data, &err);
-    // set the arguments to the kernel
-    err |= clSetKernelArg(kernel, argIndex, sizeof(cl_mem), &buffer);
-    
     return err == CL_SUCCESS;
 }
 
 /**
- * Sets an output image buffer as a kernel argument.
- * 
- * @param argIndex      Argument index.
- * @param data          Pointer to the image to be bound to the argument.
- * @param width         Image width.
- * @param height        Image height.
- * @param singleChannel Whether a single channel image is in use.
- * @return              True on success, false on fail.
+ * Enqueues a non-blocking copy from a device buffer to the host.
+ * The host memory contains the data only after @done has completed.
+ * On devices with unified memory, the buffer is mapped and read directly
+ * instead (this blocks, but there is no transfer to wait for).
+ *
+ * @param buffer   The device buffer.
+ * @param data     Pointer to the host memory.
+ * @param size     Data size in bytes.
+ * @param done     If given, set to the event of the copy.
+ * @param waitList Events that must complete before the copy starts.
+ * @return         True on success, false on fail.
  */
-bool MiniOCL::setOutputImageBuffer(cl_uint argIndex, void *data, size_t width, size_t height, bool singleChannel)
+bool MiniOCL::enqueueRead(cl_mem buffer, void *data, size_t size,
+                          Event *done /* = NULL */, const EventList &waitList /* = EventList() */)
 {
     cl_int err = CL_SUCCESS;
+    cl_event event = NULL;
 
-    if (singleChannel)
-        return setOutputBuffer(argIndex, data, width * height * sizeof(unsigned char));
+    const std::vector<cl_event> events = eventHandles(waitList);
 
-    outputIsImage = true;
+    if (unifiedMemory)
+    {
+        cl_event mapEvent = NULL;
+        void *mapped = clEnqueueMapBuffer(queue, buffer, CL_TRUE, CL_MAP_READ, 0, size,
+                                          (cl_uint)events.size(), events.empty() ? NULL : events.data(), &mapEvent, &err);
+        this->profile(OCL_CMD_TRANSFER, mapEvent);
+        Event mapDone(mapEvent);
 
-    // Pixel format: RGBA, each pixel channel is unsigned 8-bit integer
-    static const cl_image_format format = { CL_RGBA, CL_UNORM_INT8 };
+        if (err == CL_SUCCESS)
+        {
+            // a wrapped buffer is mapped to the host memory itself
+            if (mapped != data)
+                memcpy(data, mapped, size);
 
-    static const cl_image_desc description = {
-        CL_MEM_OBJECT_IMAGE2D, width, height, 0, 0, 0, 0, 0, 0, NULL
-    };
+            err = clEnqueueUnmapMemObject(queue, buffer, mapped, 0, NULL, &event);
+        }
+    } else {
+        err = clEnqueueReadBuffer(queue, buffer, CL_FALSE, 0, size, data,
+                                  (cl_uint)events.size(), events.empty() ? NULL : events.data(), &event);
+    }
 
-    size_t origin[3] = { 0, 0, 0 };
-    size_t region[3] = { width, height, 1 };
+    if (err == CL_SUCCESS)
+        this->profile(OCL_CMD_TRANSFER, event);
 
-    cl_mem_flags flags = CL_MEM_WRITE_ONLY;
-    outImg.buffer = clCreateImage(context, flags, &format, &description, NULL, &err);
-    outImg.data = data;
+    Event read(err == CL_SUCCESS ? event : NULL);
+    if (done)
+        *done = read;
 
-    // set the image origin and region
-    std::copy(origin, origin + 3, outImg.origin);
-    std::copy(region, region + 3, outImg.region);
+    return err == CL_SUCCESS;
+}
 
-    err |= clSetKernelArg(kernel, argIndex, sizeof(cl_mem), &outImg.buffer);
+/**
+ * Fills a device buffer with a byte value without a transfer from the host.
+ *
+ * @param buffer The device buffer.
+ * @param value  The value of each byte.
+ * @param size   Number of bytes to be filled.
+ * @return       True on success, false on fail.
+ */
+bool MiniOCL::fillBuffer(cl_mem buffer, unsigned char value, size_t size)
+{
+    cl_int err = CL_SUCCESS;
+
+    cl_event event = NULL;
+    err = clEnqueueFillBuffer(queue, buffer, &value, sizeof(value), 0, size, 0, NULL, &event);
+    this->profile(OCL_CMD_TRANSFER, event);
+    Event filled(event);
 
     return err == CL_SUCCESS;
 }
@@ -371,11 +1316,330 @@ bool MiniOCL::displayDeviceInfo(cl_device_id device_id /* = NULL */)
  **/
 double MiniOCL::getExecutionTime()
 {
-    cl_ulong time_start;
-    cl_ulong time_end;
+    cl_ulong time_start = 0;
+    cl_ulong time_end = 0;
+
+    // the kernel may still be running
+    if (!kernelEvent.get() || !kernelEvent.wait())
+        return 0.0;
 
-    clGetEventProfilingInfo(kernelEvent, CL_PROFILING_COMMAND_START, sizeof(time_start), &time_start, NULL);
-    clGetEventProfilingInfo(kernelEvent, CL_PROFILING_COMMAND_END, sizeof(time_end), &time_end, NULL);
+    clGetEventProfilingInfo(kernelEvent.get(), CL_PROFILING_COMMAND_START, sizeof(time_start), &time_start, NULL);
+    clGetEventProfilingInfo(kernelEvent.get(), CL_PROFILING_COMMAND_END, sizeof(time_end), &time_end, NULL);
 
     return (time_end - time_start) / 1000.0;
 }
+
+/**
+ * Starts a new pipeline stage. All the commands enqueued after this (until the
+ * next stage) are profiled and accounted to the stage. Nothing is profiled
+ * before the first stage. Profiling does not wait for the commands; the
+ * times are collected only in getProfile().
+ * 
+ * @param name Name of the stage.
+ */
+void MiniOCL::beginStage(const std::string &name)
+{
+    stageNames.push_back(name);
+}
+
+/**
+ * Records the event of an enqueued command for profiling (if a stage has
+ * been started). The caller keeps the ownership of the event.
+ * 
+ * @param type  Kind of the command.
+ * @param event Event of the command.
+ */
+void MiniOCL::profile(command_t type, cl_event event)
+{
+    if (stageNames.empty() || !event)
+        return;
+
+    clRetainEvent(event);
+
+    profiled_command_t command = { stageNames.size() - 1, type, Event(event) };
+    profiledCommands.push_back(command);
+}
+
+/**
+ * Returns the device times of the pipeline stages, split to compute,
+ * transfers and the latencies of queueing and submitting the commands.
+ * Waits for the profiled commands to finish.
+ * 
+ * @return The profile of each stage.
+ */
+std::vector<stage_profile_t> MiniOCL::getProfile()
+{
+    std::vector<stage_profile_t> stages(stageNames.size(), stage_profile_t());
+
+    for (size_t i = 0; i < stages.size(); i++)
+        stages[i].name = stageNames[i];
+
+    for (const profiled_command_t &command : profiledCommands)
+    {
+        cl_ulong queued = 0, submit = 0, start = 0, end = 0;
+        const cl_event event = command.event.get();
+
+        if (!command.event.wait())
+            continue;
+
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_QUEUED, sizeof(queued), &queued, NULL);
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_SUBMIT, sizeof(submit), &submit, NULL);
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL);
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL);
+
+        stage_profile_t &stage = stages[command.stage];
+
+        if (command.type == OCL_CMD_KERNEL) {
+            stage.compute += (end - start) / 1000.0;
+            stage.kernels++;
+        } else {
+            stage.transfer += (end - start) / 1000.0;
+            stage.transfers++;
+        }
+
+        stage.queued += (submit - queued) / 1000.0;
+        stage.submitted += (start - submit) / 1000.0;
+    }
+
+    return stages;
+}
+
+/**
+ * Clears the profile: forgets the stages and releases the events of the
+ * profiled commands. The next stage started with beginStage() is the first.
+ */
+void MiniOCL::resetProfile()
+{
+    stageNames.clear();
+    profiledCommands.clear();
+}
+
+/**
+ * Prints the profile of the pipeline stages (see getProfile()) as a table.
+ */
+void MiniOCL::printProfile()
+{
+    const std::vector<stage_profile_t> stages = this->getProfile();
+    stage_profile_t total = stage_profile_t();
+    total.name = "total";
+
+    printf("Device time per stage (ms):\n");
+    printf("  %-20s %10s %10s %10s %10s %8s %9s\n",
+           "stage", "compute", "transfer", "queued", "submitted", "kernels", "transfers");
+
+    for (size_t i = 0; i <= stages.size(); i++)
+    {
+        const stage_profile_t &s = (i < stages.size()) ? stages[i] : total;
+
+        printf("  %-20s %10.3f %10.3f %10.3f %10.3f %8u %9u\n", s.name.c_str(),
+               s.compute / 1000.0, s.transfer / 1000.0, s.queued / 1000.0, s.submitted / 1000.0,
+               (unsigned int)s.kernels, (unsigned int)s.transfers);
+
+        if (i < stages.size())
+        {
+            total.compute += s.compute;
+            total.transfer += s.transfer;
+            total.queued += s.queued;
+            total.submitted += s.submitted;
+            total.kernels += s.kernels;
+            total.transfers += s.transfers;
+        }
+    }
+}
+
+/**
+ * Exports the profile of the pipeline stages (see getProfile()) as CSV,
+ * one stage per line. The times are in microseconds.
+ * 
+ * @param fileName Name of the CSV file.
+ * @return         True on success, false on fail.
+ */
+bool MiniOCL::exportProfile(const std::string &fileName)
+{
+    std::ofstream file(fileName.c_str());
+
+    if (!file)
+    {
+        cout << "Cannot write the profile to " << fileName << "." << endl;
+        return false;
+    }
+
+    file << "stage,compute_us,transfer_us,queued_us,submitted_us,kernels,transfers" << endl;
+
+    for (const stage_profile_t &s : this->getProfile())
+    {
+        file << s.name << "," << s.compute << "," << s.transfer << "," << s.queued << ","
+             << s.submitted << "," << s.kernels << "," << s.transfers << endl;
+    }
+
+    return file.good();
+}
+
+/**
+ * Tells whether the current kernel can be run in work-groups of given size on
+ * the device, i.e. within the work-group size limit of the kernel and the
+ * work-item size limits of the device.
+ * 
+ * @param localWidth  Local (work-group) width.
+ * @param localHeight Local (work-group) height.
+ * @return            True if supported, false if not.
+ **/
+bool MiniOCL::supportsLocalSize(size_t localWidth, size_t localHeight)
+{
+    size_t maxGroupSize = 0;
+    size_t maxItemSizes[3] = { 0, 0, 0 };
+
+    if (!kernel ||
+        clGetKernelWorkGroupInfo(kernel, device_id, CL_KERNEL_WORK_GROUP_SIZE, sizeof(maxGroupSize), &maxGroupSize, NULL) != CL_SUCCESS ||
+        clGetDeviceInfo(device_id, CL_DEVICE_MAX_WORK_ITEM_SIZES, sizeof(maxItemSizes), maxItemSizes, NULL) != CL_SUCCESS)
+        return false;
+
+    return localWidth * localHeight <= maxGroupSize &&
+           localWidth <= maxItemSizes[0] && localHeight <= maxItemSizes[1];
+}
+
+/**
+ * Returns the size of the local memory of the device in bytes.
+ * 
+ * @return The local memory size.
+ **/
+size_t MiniOCL::getLocalMemSize()
+{
+    cl_ulong size = 0;
+
+    clGetDeviceInfo(device_id, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(size), &size, NULL);
+
+    return (size_t)size;
+}
+
+/**
+ * Returns the devices of given type on all the OpenCL platforms.
+ * 
+ * @param device_type OpenCL device type (e.g. CL_DEVICE_TYPE_ALL).
+ * @return            The device IDs.
+ */
+std::vector<cl_device_id> MiniOCL::listDevices(cl_device_type device_type)
+{
+    std::vector<cl_device_id> devices;
+    cl_uint platformCount = 0;
+
+    if (clGetPlatformIDs(0, NULL, &platformCount) != CL_SUCCESS || platformCount == 0)
+        return devices;
+
+    std::vector<cl_platform_id> platforms(platformCount);
+    clGetPlatformIDs(platformCount, platforms.data(), NULL);
+
+    for (cl_platform_id platform : platforms)
+    {
+        cl_uint deviceCount = 0;
+
+        // platforms without devices of the type return an error
+        if (clGetDeviceIDs(platform, device_type, 0, NULL, &deviceCount) != CL_SUCCESS || deviceCount == 0)
+            continue;
+
+        std::vector<cl_device_id> platformDevices(deviceCount);
+        clGetDeviceIDs(platform, device_type, deviceCount, platformDevices.data(), NULL);
+        devices.insert(devices.end(), platformDevices.begin(), platformDevices.end());
+    }
+
+    return devices;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// MultiOCL
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Initializes the object. The devices are set up in initialize().
+ * 
+ * @param kernelFileName Name of the file that contains the kernel code.
+ */
+MultiOCL::MultiOCL(const char *kernelFileName) : kernelFileName(kernelFileName)
+{
+    // ...
+}
+
+/**
+ * Destroys the object and the MiniOCL instance of each device.
+ */
+MultiOCL::~MultiOCL()
+{
+    for (MiniOCL *device : devices)
+        delete device;
+}
+
+/**
+ * Creates a MiniOCL instance (context, queue and program) for each device
+ * of given type on all the platforms. Devices that fail to initialize are
+ * left out.
+ * 
+ * @param device_type OpenCL device type (e.g. CL_DEVICE_TYPE_ALL).
+ * @return            Number of devices in use.
+ */
+size_t MultiOCL::initialize(cl_device_type device_type)
+{
+    for (cl_device_id device_id : MiniOCL::listDevices(device_type))
+    {
+        MiniOCL *device = new MiniOCL(kernelFileName);
+
+        if (!device->initialize(device_id))
+        {
+            cout << "Skipping an OpenCL device that failed to initialize." << endl;
+            delete device;
+            continue;
+        }
+
+        devices.push_back(device);
+        throughput.push_back(0.0);
+    }
+
+    return devices.size();
+}
+
+/**
+ * Splits @rows rows to consecutive ranges, one per device, in proportion to
+ * the measured throughput of the devices. Until every device has been
+ * measured, the rows are split evenly.
+ * 
+ * @param rows Number of rows.
+ * @return     The first row of each device's range, and @rows as the last item.
+ */
+std::vector<size_t> MultiOCL::splitRows(size_t rows)
+{
+    std::vector<size_t> starts(1, 0);
+    double total = 0.0;
+    bool measured = true;
+
+    for (double t : throughput)
+    {
+        total += t;
+        measured = measured && t > 0.0;
+    }
+
+    double share = 0.0;
+
+    for (size_t i = 0; i < devices.size(); i++)
+    {
+        share += measured ? throughput[i] / total : 1.0 / devices.size();
+
+        // the last range always ends at the last row
+        const size_t end = (i + 1 == devices.size()) ? rows : std::min((size_t)(share * rows + 0.5), rows);
+        starts.push_back(std::max(end, starts.back()));
+    }
+
+    return starts;
+}
+
+/**
+ * Records the throughput of a device (rows per microsecond) measured by a
+ * split run, to be used by the following splitRows() calls.
+ * 
+ * @param device Index of the device.
+ * @param rows   Number of rows the device processed.
+ * @param time   Time it took in microseconds.
+ */
+void MultiOCL::updateThroughput(size_t device, size_t rows, double time)
+{
+    if (rows > 0 && time > 0.0)
+        throughput[device] = rows / time;
+}
@@ -5,28 +5,139 @@
 #include <CL/cl.h>
 #include <iostream>
 #include <vector>
+#include <map>
+#include <string>
+#include <tuple>
+#include <algorithm>
 #include <fstream>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#ifdef _WIN32
+# include <direct.h>    // _mkdir
+#else
+# include <sys/stat.h>  // mkdir
+#endif
 
 #include "Application.hpp"
 
-/* Struct that contains a description of an output image. */
+/* Pass as the local size to executeKernel() to use the autotuned local size. */
+#define OCL_LOCAL_AUTO  0
+
+/* How the output of a kernel is read back to the host after the kernel. */
+typedef enum
+{
+	OCL_READ_ASYNC,			// non-blocking read, completes with the event of enqueueKernel()
+	OCL_READ_BLOCKING,		// blocking read, completed when enqueueKernel() returns
+	OCL_READ_NONE			// not read back (e.g. an unused result of a multi-output kernel)
+} read_policy_t;
+
+/* Struct that contains a description of a device buffer. */
 typedef struct
 {
 	cl_mem buffer;
 	void *data;
-	size_t origin[3];
-	size_t region[3];
-} image_buf_t;
+	size_t size;
+} buf_t;
 
-/* Struct that contains a description of an output buffer. */
+/* Struct that contains a description of a kernel output (buffer or image). */
 typedef struct
 {
 	cl_mem buffer;
-	void *data;
+	void *data;				// host memory the output is read to
+	bool isImage;			// whether to use origin and region over size
 	size_t size;
-} buf_t;
+	size_t origin[3];
+	size_t region[3];
+	read_policy_t policy;
+} output_t;
+
+/* Struct that describes a pooled buffer. Buffers with equal keys are interchangeable. */
+typedef struct buffer_key_t
+{
+	size_t size;				// size in bytes
+	size_t width;				// image width (0 for plain buffers)
+	size_t height;				// image height (0 for plain buffers)
+	cl_channel_order order;		// image channel order (0 for plain buffers)
+	cl_channel_type type;		// image channel type (0 for plain buffers)
+	cl_mem_flags flags;			// memory flags
+
+	bool operator<(const buffer_key_t &other) const
+	{
+		return std::tie(size, width, height, order, type, flags) <
+			   std::tie(other.size, other.width, other.height, other.order, other.type, other.flags);
+	}
+} buffer_key_t;
+
+/**
+ * A future-style handle to an enqueued OpenCL command. Copies refer to the
+ * same command. An empty handle (e.g. of a failed command) is always complete.
+ */
+class Event
+{
+	cl_event event;
+
+public:
+	Event(cl_event event = NULL) : event(event) {}		// takes the ownership of event
+	Event(const Event &other) : event(other.event) { if (event) clRetainEvent(event); }
+	~Event() { if (event) clReleaseEvent(event); }
+
+	Event &operator=(const Event &other)
+	{
+		if (other.event) clRetainEvent(other.event);
+		if (event) clReleaseEvent(event);
+		event = other.event;
+		return *this;
+	}
+
+	/** Blocks until the command has finished. Returns false if it failed. */
+	bool wait() const
+	{
+		return !event || clWaitForEvents(1, &event) == CL_SUCCESS;
+	}
+
+	/** Returns true if the command has finished (or failed). */
+	bool isComplete() const
+	{
+		cl_int status = CL_COMPLETE;
+		if (event)
+			clGetEventInfo(event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL);
+		return status <= CL_COMPLETE;
+	}
+
+	cl_event get() const { return event; }
+};
+
+typedef std::vector<Event> EventList;
+
+/* Kinds of profiled commands. */
+typedef enum
+{
+	OCL_CMD_KERNEL,			// kernel execution (compute)
+	OCL_CMD_TRANSFER		// read, write, map / unmap or fill of a buffer
+} command_t;
+
+/* Struct that describes a profiled command of a pipeline stage. */
+typedef struct
+{
+	size_t stage;			// index of the stage
+	command_t type;
+	Event event;
+} profiled_command_t;
+
+/* Struct that contains the device times of a pipeline stage in microseconds. */
+typedef struct
+{
+	std::string name;
+	double compute;			// kernels, START -> END
+	double transfer;		// transfers, START -> END
+	double queued;			// all commands, QUEUED -> SUBMIT (waiting in the host queue)
+	double submitted;		// all commands, SUBMIT -> START (waiting on the device)
+	size_t kernels;			// number of kernels
+	size_t transfers;		// number of transfers
+} stage_profile_t;
 
 /**
  * A simple wrapper class for accessing OpenCL.
@@ -34,20 +145,41 @@ typedef struct
 class MiniOCL
 {
 	const char* kernelFileName;
+	std::string source;					// kernel source code
 	cl_device_type device_type; 		// OpenCL target device type
-	// FIXME: Could be a union type between image_buf_t and buf_t?
-	bool outputIsImage;					// whether to use outImg over outBuf
-	image_buf_t outImg;					// the output image struct (only single one, exclusive with outBuf)
-	buf_t outBuf;						// the output buffer struct (only single one, exclusive with outImg)
+	std::vector<output_t> outputs;		// outputs of the current kernel (any number of buffers and images)
+	buf_t scratch;						// device-only buffer for passing data between kernels
+
+	// buffer pool
+	std::multimap<buffer_key_t, cl_mem> freeBuffers;	// pooled buffers ready for reuse
+	std::map<cl_mem, buffer_key_t> usedBuffers;		// pooled buffers currently in use
+	std::vector<cl_mem> kernelBuffers;				// pooled buffers bound to the current kernel
+	size_t pooledBytes;								// total size of freeBuffers
+
+	// zero-copy (host and device share the memory, e.g. CPU devices)
+	bool unifiedMemory;					// whether the device uses the host memory
+	size_t memAlignment;				// required alignment of wrapped host memory in bytes
 
     // OpenCL objects
     cl_platform_id platform;            // OpenCL platform
     cl_device_id device_id;             // device ID
     cl_context context;                 // context
     cl_command_queue queue;             // command queue
-    cl_program program;                 // program
-    cl_kernel kernel;                   // kernel
-    cl_event kernelEvent;				// kernel event (profiling)
+    cl_program program;                 // program (all kernels, built once)
+    std::map<std::string, cl_program> variants;	// programs built with other options, by options
+    cl_kernel kernel;                   // current kernel
+    std::string kernelName;             // name of the current kernel
+    std::string kernelOptions;          // build options of the current kernel's variant
+    std::map<std::string, cl_kernel> kernels;	// kernels created so far by name (and options)
+    Event kernelEvent;					// last kernel event (profiling)
+
+	// profiling
+	std::vector<std::string> stageNames;			// pipeline stages so far
+	std::vector<profiled_command_t> profiledCommands;	// commands enqueued during the stages
+
+	// work-group size autotuning
+	std::string deviceDescription;		// identifies the device and driver in the tuning table
+	std::map<std::string, std::pair<size_t, size_t>> tuning;	// best local sizes by device, kernel and size class
 
 public:
 	MiniOCL(const char* kernelFileName);
@@ -55,22 +187,84 @@ public:
 
 	// OpenCL workflow
 	bool initialize(cl_device_type device_type);
-	bool buildKernel(const char *kernelName);
+	bool initialize(cl_device_id device_id);
+	static std::vector<cl_device_id> listDevices(cl_device_type device_type);
+	bool useKernel(const char *kernelName, const std::string &options = "");
 	bool executeKernel(size_t globalWidth, size_t globalHeight, size_t localWidth, size_t localHeight);
+	bool enqueueKernel(size_t globalWidth, size_t globalHeight, size_t localWidth, size_t localHeight,
+					   Event *done = NULL, const EventList &waitList = EventList());
+	bool finish();
 
 	// values
 	bool setValue(cl_uint argIndex, void *value, size_t size);
 	// buffers
 	bool setInputBuffer(cl_uint argIndex, void *data, size_t size);
-	bool setOutputBuffer(cl_uint argIndex, void *data, size_t size);
+	bool setOutputBuffer(cl_uint argIndex, void *data, size_t size, read_policy_t policy = OCL_READ_ASYNC);
+	bool setScratchBuffer(cl_uint argIndex, size_t size);
+	bool setLocalBuffer(cl_uint argIndex, size_t size);
 	// image buffers
 	bool setInputImageBuffer(cl_uint argIndex, void *data, size_t width, size_t height, bool singleChannel);
-	bool setOutputImageBuffer(cl_uint argIndex, void *data, size_t width, size_t height, bool singleChannel);
+	bool setOutputImageBuffer(cl_uint argIndex, void *data, size_t width, size_t height, bool singleChannel,
+							  read_policy_t policy = OCL_READ_ASYNC);
+	// device buffers (owned by the caller, e.g. device-resident images)
+	cl_mem createBuffer(size_t size);
+	void releaseBuffer(cl_mem buffer);
+	bool setBuffer(cl_uint argIndex, cl_mem buffer);
+	bool enqueueWrite(cl_mem buffer, const void *data, size_t size, Event *done = NULL, const EventList &waitList = EventList());
+	bool enqueueRead(cl_mem buffer, void *data, size_t size, Event *done = NULL, const EventList &waitList = EventList());
+	bool fillBuffer(cl_mem buffer, unsigned char value, size_t size);
+	cl_mem wrapHostMemory(void *data, size_t size);
+	bool hasUnifiedMemory();
 
 	bool displayDeviceInfo(cl_device_id device_id = NULL);
 	double getExecutionTime();
+	// profiling of all commands, per pipeline stage
+	void beginStage(const std::string &name);
+	std::vector<stage_profile_t> getProfile();
+	void printProfile();
+	bool exportProfile(const std::string &fileName);
+	void resetProfile();
+	size_t getLocalMemSize();
+	bool supportsLocalSize(size_t localWidth, size_t localHeight);
 
 private:
-	bool readOutput();
+	cl_program buildProgram(const std::string &options);
+	std::string cacheFileName(const std::string &options);
+	cl_program loadProgramBinary(const std::string &fileName, const std::string &options);
+	bool saveProgramBinary(cl_program program, const std::string &fileName);
+	bool readOutputs(cl_event *event);
+	void profile(command_t type, cl_event event);
+	cl_int launch(size_t globalWidth, size_t globalHeight, size_t localWidth, size_t localHeight,
+				  const std::vector<cl_event> &waitList, cl_event *event);
+	void tuneLocalSize(size_t globalWidth, size_t globalHeight, const std::vector<cl_event> &waitList,
+					   size_t &localWidth, size_t &localHeight);
+	std::string tuningKey(size_t globalWidth, size_t globalHeight);
+	void loadTuning();
+	bool saveTuning();
+	cl_mem acquireBuffer(const buffer_key_t &key);
+	cl_mem acquireImage(size_t width, size_t height, cl_mem_flags flags);
+	void recycleKernelBuffers();
+
+};
+
+/**
+ * A set of MiniOCL instances, one for each OpenCL device of all the platforms,
+ * for splitting work (rows of an image) across the devices in proportion to
+ * their measured throughput.
+ */
+class MultiOCL
+{
+	const char *kernelFileName;
+
+public:
+	std::vector<MiniOCL *> devices;		// one instance (context and queue) per device
+	std::vector<double> throughput;		// measured rows per microsecond (0 = not measured yet)
+
+	MultiOCL(const char *kernelFileName);
+	MultiOCL(const MultiOCL &) = delete;	// the instances are owned
+	~MultiOCL();
 
+	size_t initialize(cl_device_type device_type);
+	std::vector<size_t> splitRows(size_t rows);
+	void updateThroughput(size_t device, size_t rows, double time);
 };
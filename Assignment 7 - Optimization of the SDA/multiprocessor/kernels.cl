@@ -78,40 +78,327 @@ __kernel void filter(__read_only image2d_t in,
     write_imagef( out, center, (float4)(clr / divisor) );
 }
 
+/**
+ * NOTE: Assumes grayscale image.
+ * Same as filter, but for single channel images stored in plain buffers.
+ * The edges are clamped like with the image sampler.
+ **/
+__kernel void filter_gray(__global uchar *in,
+                          __global uchar *out,
+                          __constant float *mask,
+                          const int maskSize, const float divisor,
+                          int w, int h)
+{
+    int d = maskSize / 2; // filter "edge thickness"
+    int2 center = (int2)(get_global_id(0), get_global_id(1));
+
+    if (center.x >= w || center.y >= h)
+    {
+        return;
+    }
+
+    float clr = 0.0f;
+    int maskIdx = 0;
+
+    for (int y = center.y - d; y <= center.y + d; y++)
+    {
+        int cy = clamp(y, 0, h - 1);
+
+        for (int x = center.x - d; x <= center.x + d; x++)
+        {
+            clr += in[cy * w + clamp(x, 0, w - 1)] * mask[maskIdx];
+            maskIdx++;
+        }
+    }
+
+    out[center.y * w + center.x] = convert_uchar_sat(clr / divisor);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
-// ZNCC (DISPARITY) KERNEL
+// SEPARABLE FILTER KERNELS
 ///////////////////////////////////////////////////////////////////////////////
 
 /**
- * NOTE: Assumes grayscale image.
- * Calculates ZNCC disparity between @in_this and @in_other according to
- * @windowSize, @dir and @maxSearchD parameters. The result is written to @out.
+ * First (horizontal) pass of a separable filter. Applies 1D mask @rowMask to
+ * each row of @in (RGBA or gray, @channels = 4 or 1) and writes the
+ * unscaled result to @tmp. The edges are clamped like with the image sampler.
  **/
-__kernel void calc_zncc(__global uchar *in_this,
-                        __global uchar *in_other,
+__kernel void filter_rows(__global uchar *in,
+                          __global float *tmp,
+                          __constant float *rowMask,
+                          const int maskSize,
+                          int w, int h,
+                          int channels)
+{
+    int2 pos = (int2)(get_global_id(0), get_global_id(1));
+    int d = maskSize / 2;
+
+    if (pos.x >= w || pos.y >= h)
+    {
+        return;
+    }
+
+    __global uchar *row = in + pos.y * w * channels;
+
+    for (int c = 0; c < channels; c++)
+    {
+        float sum = 0.0f;
+
+        for (int k = -d; k <= d; k++)
+            sum += row[clamp(pos.x + k, 0, w - 1) * channels + c] * rowMask[k + d];
+
+        tmp[(pos.y * w + pos.x) * channels + c] = sum;
+    }
+}
+
+/**
+ * Second (vertical) pass of a separable filter. Applies 1D mask @colMask to
+ * each column of @tmp and writes the result divided by @divisor to @out.
+ **/
+__kernel void filter_cols(__global float *tmp,
+                          __global uchar *out,
+                          __constant float *colMask,
+                          const int maskSize,
+                          int w, int h,
+                          int channels,
+                          const float divisor)
+{
+    int2 pos = (int2)(get_global_id(0), get_global_id(1));
+    int d = maskSize / 2;
+
+    if (pos.x >= w || pos.y >= h)
+    {
+        return;
+    }
+
+    for (int c = 0; c < channels; c++)
+    {
+        float sum = 0.0f;
+
+        for (int k = -d; k <= d; k++)
+            sum += tmp[(clamp(pos.y + k, 0, h - 1) * w + pos.x) * channels + c] * colMask[k + d];
+
+        out[(pos.y * w + pos.x) * channels + c] = convert_uchar_sat_rte(sum / divisor);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// BOX FILTER KERNELS
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+ * First (horizontal) pass of a box filter of radius @r. Each row is split to
+ * segments of @segment pixels, and each work item computes a running sum
+ * along one segment of one channel (dim 0) of one row (dim 1) of @in, so
+ * there are enough work items to fill the device and the cost per pixel is
+ * nearly constant. The sums are written to @tmp. The edges are clamped like
+ * with the image sampler.
+ **/
+__kernel void box_filter_rows(__global uchar *in,
+                              __global uint *tmp,
+                              int w, int h,
+                              int channels,
+                              int r,
+                              int segment)
+{
+    int c = get_global_id(0) % channels;
+    int x0 = (get_global_id(0) / channels) * segment;
+    int y = get_global_id(1);
+
+    if (y >= h || x0 >= w)
+    {
+        return;
+    }
+
+    int x1 = min(x0 + segment, w);
+    __global uchar *row = in + y * w * channels + c;
+    __global uint *out = tmp + y * w * channels + c;
+    uint sum = 0;
+
+    for (int x = x0 - r; x <= x0 + r; x++)
+        sum += row[clamp(x, 0, w - 1) * channels];
+
+    for (int x = x0; x < x1; x++)
+    {
+        out[x * channels] = sum;
+        sum += row[min(x + r + 1, w - 1) * channels];
+        sum -= row[max(x - r, 0) * channels];
+    }
+}
+
+/**
+ * Second (vertical) pass of a box filter of radius @r. Each work item
+ * computes a running sum down one column of the row sums in @tmp and
+ * writes the weighted result to @out.
+ **/
+__kernel void box_filter_cols(__global uint *tmp,
+                              __global uchar *out,
+                              int w, int h,
+                              int channels,
+                              int r,
+                              const float weight, const float divisor)
+{
+    int i = get_global_id(0);   // column (byte) index within a row
+    int rowLength = w * channels;
+
+    if (i >= rowLength)
+    {
+        return;
+    }
+
+    uint sum = 0;
+
+    for (int y = -r; y <= r; y++)
+        sum += tmp[clamp(y, 0, h - 1) * rowLength + i];
+
+    for (int y = 0; y < h; y++)
+    {
+        out[y * rowLength + i] = convert_uchar_sat_rte(sum * weight / divisor);
+        sum += tmp[min(y + r + 1, h - 1) * rowLength + i];
+        sum -= tmp[max(y - r, 0) * rowLength + i];
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// DOWNSCALE KERNEL
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Scales image @in (RGBA or gray, @channels = 4 or 1) down by @factor. Each
+ * work item averages one factor x factor block (all channels) and writes one
+ * pixel of @out, which is (w / factor) x (h / factor) with the same channels.
+ **/
+__kernel void downscale(__global uchar *in,
                         __global uchar *out,
                         int w, int h,
-                        char windowSize,
-                        char dir,
-                        unsigned int maxSearchD)
+                        int channels,
+                        int factor)
 {
     int2 pos = (int2)(get_global_id(0), get_global_id(1));
-    //int w = get_global_size(0); //float w = get_image_width(in_this);
-    //int h = get_global_size(1); //float h = get_image_height(in_this);
-    const char halfWindow = (windowSize - 1) / 2;
+    int outW = w / factor;
+    int outH = h / factor;
 
-    // skip the edges
-    if (pos.x < halfWindow || pos.y < halfWindow ||
-        pos.x >= (w - halfWindow) || pos.y >= (h - halfWindow))
+    if (pos.x >= outW || pos.y >= outH)
     {
         return;
     }
 
+    uint scale = factor * factor;
+
+    if (channels == 1)
+    {
+        uint sum = 0;
+
+        for (int y = pos.y * factor; y < (pos.y + 1) * factor; y++) {
+            for (int x = pos.x * factor; x < (pos.x + 1) * factor; x++) {
+                sum += in[y * w + x];
+            }
+        }
+
+        out[pos.y * outW + pos.x] = (uchar)((sum + scale / 2) / scale);
+    } else {
+        uint4 sum = (uint4)(0);
+
+        for (int y = pos.y * factor; y < (pos.y + 1) * factor; y++) {
+            for (int x = pos.x * factor; x < (pos.x + 1) * factor; x++) {
+                sum += convert_uint4(vload4(y * w + x, in));
+            }
+        }
+
+        vstore4(convert_uchar4((sum + scale / 2) / scale), pos.y * outW + pos.x, out);
+    }
+}
+
+/**
+ * Scales image @in (RGBA or gray, @channels = 4 or 1) down by @factor and
+ * converts it to grayscale. Each work item averages one factor x factor block
+ * and writes one pixel of @out, which is (w / factor) x (h / factor).
+ * Uses the same fixed point NTSC weights as the CPU version.
+ **/
+__kernel void downscale_gray(__global uchar *in,
+                             __global uchar *out,
+                             int w, int h,
+                             int channels,
+                             int factor)
+{
+    int2 pos = (int2)(get_global_id(0), get_global_id(1));
+    int outW = w / factor;
+    int outH = h / factor;
+
+    if (pos.x >= outW || pos.y >= outH)
+    {
+        return;
+    }
+
+    uint sum = 0;
+    uint scale = factor * factor;
+
+    if (channels == 1)
+    {
+        for (int y = pos.y * factor; y < (pos.y + 1) * factor; y++) {
+            for (int x = pos.x * factor; x < (pos.x + 1) * factor; x++) {
+                sum += in[y * w + x];
+            }
+        }
+    } else {
+        for (int y = pos.y * factor; y < (pos.y + 1) * factor; y++) {
+            for (int x = pos.x * factor; x < (pos.x + 1) * factor; x++) {
+                uint4 clr = convert_uint4(vload4(y * w + x, in));
+                sum += 306 * clr.x + 601 * clr.y + 117 * clr.z;
+            }
+        }
+        scale *= 1024;
+    }
+
+    out[pos.y * outW + pos.x] = (uchar)((sum + scale / 2) / scale);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ZNCC (DISPARITY) KERNEL
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+ * The ZNCC kernels can be specialized by building them with -DWINDOW_SIZE=n,
+ * -DSEARCH_DIR=d and -DMAX_SEARCH_D=n. The values then replace the kernel
+ * arguments as compile-time constants, so the compiler can e.g. unroll the
+ * window loops.
+ **/
+#ifdef WINDOW_SIZE
+# define SPECIALIZE_WINDOW_SIZE(arg)    arg = WINDOW_SIZE
+#else
+# define SPECIALIZE_WINDOW_SIZE(arg)
+#endif
+#ifdef SEARCH_DIR
+# define SPECIALIZE_SEARCH_DIR(arg)     arg = SEARCH_DIR
+#else
+# define SPECIALIZE_SEARCH_DIR(arg)
+#endif
+#ifdef MAX_SEARCH_D
+# define SPECIALIZE_MAX_SEARCH_D(arg)   arg = MAX_SEARCH_D
+#else
+# define SPECIALIZE_MAX_SEARCH_D(arg)
+#endif
+
+/**
+ * NOTE: Assumes grayscale image.
+ * Returns the disparity with the best ZNCC at @pos between @in_this and
+ * @in_other. @pos must be at least half a window away from the edges.
+ **/
+uchar zncc_disparity(__global uchar *in_this,
+                     __global uchar *in_other,
+                     int2 pos,
+                     int w,
+                     char windowSize,
+                     char dir,
+                     unsigned int maxSearchD)
+{
+    const char halfWindow = (windowSize - 1) / 2;
+
     // Calculate left window average.
     float windowSum = 0;
     float clr;
-    for (unsigned int y = pos.y - halfWindow; y < pos.y + halfWindow; y++) {
-        for (unsigned int x = pos.x - halfWindow; x < pos.x + halfWindow; x++) {
+    for (unsigned int y = pos.y - halfWindow; y <= pos.y + halfWindow; y++) {
+        for (unsigned int x = pos.x - halfWindow; x <= pos.x + halfWindow; x++) {
             windowSum += in_this[y * w + x] / 255.0f; //clr = read_imagef( in_this, sampler, (int2)(x, y) );
         }
     }
@@ -129,8 +416,8 @@ __kernel void calc_zncc(__global uchar *in_this,
     {
         // Calculate right window average.
         windowSum = 0;
-        for (unsigned int y = pos.y - halfWindow; y < pos.y + halfWindow; y++) {
-            for (unsigned int x = pos.x + (dir * d) - halfWindow; x < pos.x + (dir * d) + halfWindow; x++) {
+        for (unsigned int y = pos.y - halfWindow; y <= pos.y + halfWindow; y++) {
+            for (unsigned int x = pos.x + (dir * d) - halfWindow; x <= pos.x + (dir * d) + halfWindow; x++) {
                 windowSum += in_other[y * w + x] / 255.0f; //clr = read_imagef( in_other, sampler, (int2)(x, y) );
             }
         }
@@ -174,12 +461,415 @@ __kernel void calc_zncc(__global uchar *in_this,
         //float p = bestD / 255.0f;
     }
 
-    out[pos.y * w + pos.x] = bestD; //write_imagef( out, pos, (float4)(p, p, p, 1.0f) );
+    return bestD;
+}
+
+/**
+ * NOTE: Assumes grayscale image.
+ * Calculates ZNCC disparity between @in_this and @in_other according to
+ * @windowSize, @dir and @maxSearchD parameters. The result is written to @out.
+ **/
+__kernel void calc_zncc(__global uchar *in_this,
+                        __global uchar *in_other,
+                        __global uchar *out,
+                        int w, int h,
+                        char windowSize,
+                        char dir,
+                        unsigned int maxSearchD)
+{
+    // compile-time constants in specialized builds
+    SPECIALIZE_WINDOW_SIZE(windowSize);
+    SPECIALIZE_SEARCH_DIR(dir);
+    SPECIALIZE_MAX_SEARCH_D(maxSearchD);
+
+    int2 pos = (int2)(get_global_id(0), get_global_id(1));
+    //int w = get_global_size(0); //float w = get_image_width(in_this);
+    //int h = get_global_size(1); //float h = get_image_height(in_this);
+    const char halfWindow = (windowSize - 1) / 2;
 
-    //float4 clr1 = read_imagef( in_this, sampler, pos );
-    //float4 clr2 = read_imagef( in_other, sampler, pos );
-    //float4 clr = (float4)((clr1 + clr2) / 2);
-    //write_imagef( out, pos, (float4)(leftAvg, leftAvg, leftAvg, 1.0f) );
+    // skip the edges
+    if (pos.x < halfWindow || pos.y < halfWindow ||
+        pos.x >= (w - halfWindow) || pos.y >= (h - halfWindow))
+    {
+        return;
+    }
+
+    out[pos.y * w + pos.x] = zncc_disparity(in_this, in_other, pos, w, windowSize, dir, maxSearchD);
+}
+
+/**
+ * NOTE: Assumes grayscale image.
+ * Calculates both disparity maps in one launch: left to right (@out_left)
+ * and right to left (@out_right). Each work-item reads the same rows of both
+ * images for the two directions, and the images are traversed only once.
+ **/
+__kernel void calc_zncc_lr(__global uchar *in_left,
+                           __global uchar *in_right,
+                           __global uchar *out_left,
+                           __global uchar *out_right,
+                           int w, int h,
+                           char windowSize,
+                           unsigned int maxSearchD)
+{
+    // compile-time constants in specialized builds
+    SPECIALIZE_WINDOW_SIZE(windowSize);
+    SPECIALIZE_MAX_SEARCH_D(maxSearchD);
+
+    int2 pos = (int2)(get_global_id(0), get_global_id(1));
+    const char halfWindow = (windowSize - 1) / 2;
+
+    // skip the edges
+    if (pos.x < halfWindow || pos.y < halfWindow ||
+        pos.x >= (w - halfWindow) || pos.y >= (h - halfWindow))
+    {
+        return;
+    }
+
+    out_left[pos.y * w + pos.x] = zncc_disparity(in_left, in_right, pos, w, windowSize, -1, maxSearchD);
+    out_right[pos.y * w + pos.x] = zncc_disparity(in_right, in_left, pos, w, windowSize, 1, maxSearchD);
+}
+
+/**
+ * NOTE: Assumes grayscale image.
+ * Calculates the cross-checked disparity map in one launch: both directions
+ * are calculated for each pixel like in calc_zncc_lr and compared right away
+ * like in cross_check, so neither disparity map is stored. The left-to-right
+ * disparity is written to @out if the two differ by at most @threshold, and
+ * zero otherwise.
+ **/
+__kernel void calc_zncc_cross(__global uchar *in_left,
+                              __global uchar *in_right,
+                              __global uchar *out,
+                              int w, int h,
+                              char windowSize,
+                              unsigned int maxSearchD,
+                              unsigned int threshold)
+{
+    // compile-time constants in specialized builds
+    SPECIALIZE_WINDOW_SIZE(windowSize);
+    SPECIALIZE_MAX_SEARCH_D(maxSearchD);
+
+    int2 pos = (int2)(get_global_id(0), get_global_id(1));
+    const char halfWindow = (windowSize - 1) / 2;
+
+    // skip the edges
+    if (pos.x < halfWindow || pos.y < halfWindow ||
+        pos.x >= (w - halfWindow) || pos.y >= (h - halfWindow))
+    {
+        return;
+    }
+
+    uchar leftD = zncc_disparity(in_left, in_right, pos, w, windowSize, -1, maxSearchD);
+    uchar rightD = zncc_disparity(in_right, in_left, pos, w, windowSize, 1, maxSearchD);
+
+    out[pos.y * w + pos.x] = (abs(leftD - rightD) > threshold) ? 0 : leftD;
+}
+
+/**
+ * NOTE: Assumes grayscale image.
+ * Same as calc_zncc, but each work-group first loads its tile of @in_this and
+ * the strip of @in_other covering all the search positions (plus the window
+ * halo) to local memory. The sums and variances of the right windows are
+ * computed once per group and shared by all the work-items, so the inner
+ * loop only accumulates the products from local memory. The (co)variances
+ * are kept in integers times n (n * sum(p^2) - sum(p)^2), so a flat window
+ * has exactly zero variance; only the final product goes to float.
+ *
+ * Local buffers (r = half window, D = maxSearchD, local size TW x TH):
+ *   leftTile   (TW + 2r)     * (TH + 2r) uchars
+ *   rightTile  (TW + 2r + D) * (TH + 2r) uchars
+ *   rightSum   (TW + D)      * TH        ints
+ *   rightVar   (TW + D)      * TH        longs
+ **/
+__kernel void calc_zncc_tiled(__global uchar *in_this,
+                              __global uchar *in_other,
+                              __global uchar *out,
+                              int w, int h,
+                              char windowSize,
+                              char dir,
+                              unsigned int maxSearchD,
+                              __local uchar *leftTile,
+                              __local uchar *rightTile,
+                              __local int *rightSum,
+                              __local long *rightVar)
+{
+    // compile-time constants in specialized builds
+    SPECIALIZE_WINDOW_SIZE(windowSize);
+    SPECIALIZE_SEARCH_DIR(dir);
+    SPECIALIZE_MAX_SEARCH_D(maxSearchD);
+
+    const int x = get_global_id(0);
+    const int y = get_global_id(1);
+    const int lx = get_local_id(0);
+    const int ly = get_local_id(1);
+    const int tw = get_local_size(0);
+    const int th = get_local_size(1);
+    const int lid = ly * tw + lx;
+    const int groupSize = tw * th;
+
+    const int r = (windowSize - 1) / 2;
+    const int D = maxSearchD;
+    const long n = windowSize * windowSize;
+
+    // tile origins in the image
+    const int gx = get_group_id(0) * tw;
+    const int gy = get_group_id(1) * th;
+    const int leftX = gx - r;
+    const int rightX = (dir > 0) ? gx - r : gx - r - D;
+    const int topY = gy - r;
+
+    const int leftW = tw + 2 * r;
+    const int rightW = tw + 2 * r + D;
+    const int tileH = th + 2 * r;
+    const int statsW = tw + D;
+
+    // 1. load the tiles cooperatively; pixels outside of the image are zero
+    //    (they are never used by the pixels that are computed)
+    for (int i = lid; i < leftW * tileH; i += groupSize)
+    {
+        const int ix = leftX + i % leftW;
+        const int iy = topY + i / leftW;
+        leftTile[i] = (ix >= 0 && ix < w && iy >= 0 && iy < h) ? in_this[iy * w + ix] : 0;
+    }
+
+    for (int i = lid; i < rightW * tileH; i += groupSize)
+    {
+        const int ix = rightX + i % rightW;
+        const int iy = topY + i / rightW;
+        rightTile[i] = (ix >= 0 && ix < w && iy >= 0 && iy < h) ? in_other[iy * w + ix] : 0;
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // 2. sums and variances (times n) of all the right windows of the tile
+    for (int i = lid; i < statsW * th; i += groupSize)
+    {
+        const int sx = i % statsW;
+        const int sy = i / statsW;
+        int sum = 0;
+        int sumSq = 0;
+
+        for (int wy = 0; wy < windowSize; wy++) {
+            for (int wx = 0; wx < windowSize; wx++) {
+                const int p = rightTile[(sy + wy) * rightW + sx + wx];
+                sum += p;
+                sumSq += p * p;
+            }
+        }
+
+        rightSum[i] = sum;
+        rightVar[i] = n * sumSq - (long)sum * sum;
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // skip the edges (only after the barriers)
+    if (x < r || y < r || x >= (w - r) || y >= (h - r))
+    {
+        return;
+    }
+
+    // 3. the left window of this work-item
+    int leftSum = 0;
+    int leftSumSq = 0;
+
+    for (int wy = 0; wy < windowSize; wy++) {
+        for (int wx = 0; wx < windowSize; wx++) {
+            const int p = leftTile[(ly + wy) * leftW + lx + wx];
+            leftSum += p;
+            leftSumSq += p * p;
+        }
+    }
+
+    const long leftVar = n * leftSumSq - (long)leftSum * leftSum;
+
+    uchar bestD = 0;                // tracks the distance with best correlation
+    float maxCorrelation = 0.0f;    // tracks the best correlation (ZNCC)
+
+    // stops at the left/right edge
+    const int maxD = (dir > 0)
+        ? min(D, (w - 1 - r) - x)
+        : min(D, x - r);
+
+    for (int d = 0; d <= maxD; d++)
+    {
+        // left edge of the right window in the strip (and in the stats)
+        const int sx = (dir > 0) ? lx + d : lx + D - d;
+        int productSum = 0;
+
+        for (int wy = 0; wy < windowSize; wy++) {
+            __local const uchar *leftRow = leftTile + (ly + wy) * leftW + lx;
+            __local const uchar *rightRow = rightTile + (ly + wy) * rightW + sx;
+
+            for (int wx = 0; wx < windowSize; wx++)
+                productSum += leftRow[wx] * rightRow[wx];
+        }
+
+        // ZNCC = sum((L - avgL) * (R - avgR)) / sqrt(sum((L - avgL)^2) * sum((R - avgR)^2)),
+        // with the numerator and both sums under the root multiplied by n
+        const long rightVarN = rightVar[ly * statsW + sx];
+
+        if (leftVar == 0 || rightVarN == 0)
+            continue;   // flat window, correlation is undefined
+
+        const long upper = n * productSum - (long)leftSum * rightSum[ly * statsW + sx];
+        const float correlation = (float)upper * rsqrt((float)leftVar * (float)rightVarN);
+
+        // update disparity value for pixel (x,y)
+        if (correlation > maxCorrelation)
+        {
+            maxCorrelation = correlation;
+            bestD = d;
+        }
+    }
+
+    out[y * w + x] = bestD;
+}
+
+/**
+ * NOTE: Assumes grayscale image.
+ * Same as calc_zncc, but the disparities are evaluated in blocks of 8. For a
+ * window pixel, the right pixels of 8 consecutive disparities are adjacent,
+ * so they are fetched with a single vload8 and each left pixel is loaded once
+ * per block instead of once per disparity. The best disparity of the block is
+ * then picked in order of d, and the disparities left over after the last
+ * full block are done one at a time. The (co)variances are kept in integers
+ * times n, like in calc_zncc_tiled.
+ **/
+__kernel void calc_zncc_vec(__global uchar *in_this,
+                            __global uchar *in_other,
+                            __global uchar *out,
+                            int w, int h,
+                            char windowSize,
+                            char dir,
+                            unsigned int maxSearchD)
+{
+    // compile-time constants in specialized builds
+    SPECIALIZE_WINDOW_SIZE(windowSize);
+    SPECIALIZE_SEARCH_DIR(dir);
+    SPECIALIZE_MAX_SEARCH_D(maxSearchD);
+
+    const int x = get_global_id(0);
+    const int y = get_global_id(1);
+    const int r = (windowSize - 1) / 2;
+    const long n = windowSize * windowSize;
+
+    // skip the edges
+    if (x < r || y < r || x >= (w - r) || y >= (h - r))
+    {
+        return;
+    }
+
+    // top-left corner of the left window
+    __global const uchar *leftWindow = in_this + (y - r) * w + (x - r);
+    int leftSum = 0;
+    int leftSumSq = 0;
+
+    for (int wy = 0; wy < windowSize; wy++) {
+        for (int wx = 0; wx < windowSize; wx++) {
+            const int p = leftWindow[wy * w + wx];
+            leftSum += p;
+            leftSumSq += p * p;
+        }
+    }
+
+    const long leftVar = n * leftSumSq - (long)leftSum * leftSum;
+
+    // a flat left window has no correlation with any right window
+    if (leftVar == 0)
+    {
+        out[y * w + x] = 0;
+        return;
+    }
+
+    uchar bestD = 0;                // tracks the distance with best correlation
+    float maxCorrelation = 0.0f;    // tracks the best correlation (ZNCC)
+
+    // stops at the left/right edge
+    const int maxD = (dir > 0)
+        ? min((int)maxSearchD, (w - 1 - r) - x)
+        : min((int)maxSearchD, x - r);
+
+    int d = 0;
+
+    // full blocks of 8 disparities; all their pixels are inside the image
+    for (; d + 7 <= maxD; d += 8)
+    {
+        // lane k is the disparity d + k (dir > 0) or d + 7 - k (dir < 0)
+        __global const uchar *rightWindow = in_other + (y - r) * w + (x - r) + ((dir > 0) ? d : -d - 7);
+        int8 rightSum = 0;
+        int8 rightSumSq = 0;
+        int8 productSum = 0;
+
+        for (int wy = 0; wy < windowSize; wy++) {
+            for (int wx = 0; wx < windowSize; wx++) {
+                const int l = leftWindow[wy * w + wx];
+                const int8 r8 = convert_int8(vload8(0, rightWindow + wy * w + wx));
+
+                rightSum += r8;
+                rightSumSq += r8 * r8;
+                productSum += l * r8;
+            }
+        }
+
+        const long8 sumR = convert_long8(rightSum);
+        long upper[8];
+        long rightVar[8];
+        vstore8(n * convert_long8(productSum) - leftSum * sumR, 0, upper);
+        vstore8(n * convert_long8(rightSumSq) - sumR * sumR, 0, rightVar);
+
+        for (int i = 0; i < 8; i++)
+        {
+            const int k = (dir > 0) ? i : 7 - i;
+
+            if (rightVar[k] == 0)
+                continue;   // flat window, correlation is undefined
+
+            const float correlation = (float)upper[k] * rsqrt((float)leftVar * (float)rightVar[k]);
+
+            if (correlation > maxCorrelation)
+            {
+                maxCorrelation = correlation;
+                bestD = d + i;
+            }
+        }
+    }
+
+    // the rest of the disparities
+    for (; d <= maxD; d++)
+    {
+        __global const uchar *rightWindow = in_other + (y - r) * w + (x - r) + dir * d;
+        int rightSum = 0;
+        int rightSumSq = 0;
+        int productSum = 0;
+
+        for (int wy = 0; wy < windowSize; wy++) {
+            for (int wx = 0; wx < windowSize; wx++) {
+                const int l = leftWindow[wy * w + wx];
+                const int p = rightWindow[wy * w + wx];
+
+                rightSum += p;
+                rightSumSq += p * p;
+                productSum += l * p;
+            }
+        }
+
+        const long upper = n * productSum - (long)leftSum * rightSum;
+        const long rightVar = n * rightSumSq - (long)rightSum * rightSum;
+
+        if (rightVar == 0)
+            continue;
+
+        const float correlation = (float)upper * rsqrt((float)leftVar * (float)rightVar);
+
+        if (correlation > maxCorrelation)
+        {
+            maxCorrelation = correlation;
+            bestD = d;
+        }
+    }
+
+    out[y * w + x] = bestD;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -198,6 +888,10 @@ __kernel void cross_check(__global uchar *in_left,
     int2 pos = (int2)(get_global_id(0), get_global_id(1));
     int idx = pos.y * w + pos.x;
 
+    // the global size may be rounded up to a multiple of the local size
+    if (pos.x >= w || pos.y >= h)
+        return;
+
     uchar leftPixel = in_left[idx];       //float4 leftPixel = read_imagef( in_left, sampler, pos );
     uchar rightPixel = in_right[idx];     //float4 rightPixel = read_imagef( in_right, sampler, pos );
 
@@ -215,100 +909,176 @@ __kernel void cross_check(__global uchar *in_left,
 
 /**
  * Performs a very simple occlusion fill. For each pixel, the nearest non-zero
- * pixel on the left is used. If none is found, write a black opaque pixel.
+ * pixel on the left is used, or black if there is none. Each work item goes
+ * through one row (of @h) once, carrying the last non-zero pixel, so a row is
+ * O(w) instead of O(w) per zero pixel.
  * + very fast
  * - the resulting fill has 'tears' on some edges
  **/
-__kernel void occlusion_fill_left(__global uchar *in,
+__kernel void occlusion_scan_left(__global uchar *in,
                                   __global uchar *out,
                                   int w, int h)
 {
-    int2 pos = (int2)(get_global_id(0), get_global_id(1));
-    int idx = pos.y * w + pos.x;
+    int y = get_global_id(0);
+
+    if (y >= h)
+        return;
 
-    uchar clr = in[idx];   //float4 clr = read_imagef( in, sampler, pos );
+    uchar last = 0;     // black if no pixels on the left
 
-    // just copy the pixel...
-    if (clr > 0)
+    for (int x = 0; x < w; x++)
     {
-        out[idx] = clr;     //write_imagef( out, pos, clr );
-        return;
+        uchar clr = in[y * w + x];
+
+        if (clr > 0)
+            last = clr;
+
+        out[y * w + x] = last;
     }
+}
 
-#pragma unroll
-    for (int x0 = pos.x; x0 >= 0; x0--)
+/**
+ * First pass of the nearest occlusion fill. Each zero pixel is replaced with
+ * the nearest non-zero pixel in the 8 directions, i.e. the first one that a
+ * square spiral search (rings i = 1 ... w - 1, dirX and dirY from -1 to 1 in
+ * each ring) would find, or black if there is none.
+ *
+ * Each work item scans one line of a family (0 = rows, 1 = columns,
+ * 2 = diagonals down-right, 3 = diagonals up-right) in both directions,
+ * carrying the last non-zero pixel. The nearest non-zero pixel found for each
+ * zero pixel is merged to @best, which must be initialized to 0xFFFFFFFF
+ * before the first family.
+ *
+ * The candidates are packed as (distance << 12 | rank << 8 | value), so the
+ * minimum is the nearest one, and ties are broken by the rank, which is the
+ * order in which the spiral search checks the 8 directions. Each pixel is
+ * on one line per family, so the families are run one after another without
+ * atomics, and the whole fill is O(w * h).
+ **/
+__kernel void occlusion_scan_lines(__global uchar *in,
+                                   __global uint *best,
+                                   int w, int h,
+                                   int family)
+{
+    int line = get_global_id(0);
+    int x0, y0, stepX, stepY, length;
+    uint rankForward, rankBackward;     // rank of the direction of the carried pixel
+    int maxDistance = w + h;
+
+    if (family == 0) {              // rows, left to right
+        if (line >= h) return;
+        x0 = 0; y0 = line; stepX = 1; stepY = 0; length = w;
+        rankForward = 1; rankBackward = 7;
+    } else if (family == 1) {       // columns, top to bottom
+        if (line >= w) return;
+        x0 = line; y0 = 0; stepX = 0; stepY = 1; length = h;
+        rankForward = 3; rankBackward = 5;
+        maxDistance = w;            // the spiral search goes only w steps
+    } else if (family == 2) {       // diagonals, down-right from the left or top edge
+        if (line >= w + h - 1) return;
+        x0 = (line < h) ? 0 : line - h + 1;
+        y0 = (line < h) ? h - 1 - line : 0;
+        stepX = 1; stepY = 1; length = min(w - x0, h - y0);
+        rankForward = 0; rankBackward = 8;
+    } else {                        // diagonals, up-right from the left or bottom edge
+        if (line >= w + h - 1) return;
+        x0 = (line < h) ? 0 : line - h + 1;
+        y0 = (line < h) ? line : h - 1;
+        stepX = 1; stepY = -1; length = min(w - x0, y0 + 1);
+        rankForward = 2; rankBackward = 6;
+    }
+
+    // forward, then backward along the line
+    for (int pass = 0; pass < 2; pass++)
     {
-        //unsigned char p0 = this->getGrayPixel(x0, y);
-        uchar clr0 = in[pos.y * w + x0]; //float4 clr0 = read_imagef( in, sampler, (int2)(x0, pos.y) );
+        int last = -1;
+        uint lastClr = 0;
 
-        if (clr0 > 0)
+        for (int i = 0; i < length; i++)
         {
-            // replace current pixel (that is zero) with clr0
-            out[idx] = clr0; //write_imagef( out, pos, clr0 );
-            return;
+            int k = (pass == 0) ? i : length - 1 - i;
+            int idx = (y0 + k * stepY) * w + (x0 + k * stepX);
+            uchar clr = in[idx];
+
+            if (clr > 0) {
+                last = i;
+                lastClr = clr;
+            } else if (last >= 0 && i - last < maxDistance) {
+                uint rank = (pass == 0) ? rankForward : rankBackward;
+                best[idx] = min(best[idx], ((uint)(i - last) << 12) | (rank << 8) | lastClr);
+            }
         }
     }
-
-    // if no pixels found on the left, replace with black pixel
-    out[idx] = 0;   //write_imagef( out, pos, (float4)(0.0f, 0.0f, 0.0f, 1.0f) );
 }
 
 /**
- * Performs more complicated occlusion fill. For each pixel, the nearest non-zero
- * pixel is searched using a spiral-like search (square). If none is found
- * (impossible), write a black opaque pixel.
- * + more accurate fill
- * - more complex -> slightly slower
- */
-__kernel void occlusion_fill_nearest(__global uchar *in,
+ * Second pass of the nearest occlusion fill: copies the non-zero pixels and
+ * replaces the zero ones with the nearest found by occlusion_scan_lines (or
+ * black if none).
+ **/
+__kernel void occlusion_scan_resolve(__global uchar *in,
+                                     __global uint *best,
                                      __global uchar *out,
                                      int w, int h)
 {
     int2 pos = (int2)(get_global_id(0), get_global_id(1));
     int idx = pos.y * w + pos.x;
-    //float w = get_image_width(in);
-    //float h = get_image_height(in);
 
-    uchar clr = in[idx];    //float4 clr = read_imagef( in, sampler, pos );
+    if (pos.x >= w || pos.y >= h)
+        return;
+
+    uchar clr = in[idx];
+    uint nearest = best[idx];
 
-    // just copy the pixel...
     if (clr > 0)
-    {
-        out[idx] = clr;     //write_imagef( out, pos, clr );
+        out[idx] = clr;
+    else
+        out[idx] = (nearest == 0xFFFFFFFF) ? 0 : (uchar)(nearest & 0xFF);
+}
+
+#ifdef MEDIAN_RADIUS
+/**
+ * Median filter for small windows of (2 * MEDIAN_RADIUS + 1)^2 pixels, with
+ * the edges clamped. The window is gathered to private memory and the median
+ * is found bit by bit from the most significant one: a bit is kept if at most
+ * half of the window is below the value with it set. Must be built with
+ * -DMEDIAN_RADIUS=<radius>.
+ **/
+__kernel void median_filter(__global uchar *in,
+                            __global uchar *out,
+                            int w, int h)
+{
+    int2 pos = (int2)(get_global_id(0), get_global_id(1));
+
+    if (pos.x >= w || pos.y >= h)
         return;
+
+    const int n = (2 * MEDIAN_RADIUS + 1) * (2 * MEDIAN_RADIUS + 1);
+    uchar window[(2 * MEDIAN_RADIUS + 1) * (2 * MEDIAN_RADIUS + 1)];
+    int i = 0;
+
+    for (int dy = -MEDIAN_RADIUS; dy <= MEDIAN_RADIUS; dy++)
+    {
+        int y = clamp(pos.y + dy, 0, h - 1);
+
+        for (int dx = -MEDIAN_RADIUS; dx <= MEDIAN_RADIUS; dx++)
+            window[i++] = in[y * w + clamp(pos.x + dx, 0, w - 1)];
     }
 
-    // Spirals out in X and Y, checking each pixel for the nearest non-zero pixel.
+    uint median = 0;
 
-    //for (int x0 = pos.x; x0 >= 0; x0--)
-    for (int i = 1; i < w; i++)
+    for (int bit = 7; bit >= 0; bit--)
     {
-//#pragma unroll 3
-        for (char dirX = -1; dirX <= 1; dirX++)
-        {
-            int x0 = pos.x + dirX * i;
-            if (x0 < 0 || x0 > (w - 1))
-                continue;
-#pragma unroll 3
-            for (char dirY = -1; dirY <= 1; dirY++)
-            {
-                int y0 = pos.y + dirY * i;
-                if (y0 < 0 || y0 > (h - 1))
-                    continue;
-
-                //unsigned char p0 = this->getGrayPixel(x0, y);
-                uchar clr0 = in[y0 * w + x0];   //float4 clr0 = read_imagef( in, sampler, (int2)(x0, y0) );
-
-                if (clr0 > 0)
-                {
-                    // replace current pixel (that is zero) with clr0
-                    out[idx] = clr0;    //write_imagef( out, pos, clr0 );
-                    return;
-                }
-            }
-        }
+        uint candidate = median | (1u << bit);
+        int below = 0;
+
+        for (int j = 0; j < n; j++)
+            below += (window[j] < candidate);
+
+        if (below <= n / 2)
+            median = candidate;
     }
 
-    // if no pixels found on the left, replace with black pixel
-    out[idx] = 0;   //write_imagef( out, pos, (float4)(0.0f, 0.0f, 0.0f, 1.0f) );
+    out[pos.y * w + pos.x] = (uchar)median;
 }
+#endif
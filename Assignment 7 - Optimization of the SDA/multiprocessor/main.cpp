@@ -20,6 +20,15 @@ using std::endl;
         return EXIT_FAILURE;                                \
     }
 
+/**
+ * Starts profiling a new pipeline stage on the OpenCL device (if any).
+ **/
+#ifdef USE_OCL
+# define BEGIN_STAGE(name)  ocl.beginStage(name);
+#else
+# define BEGIN_STAGE(name)
+#endif /* USE_OCL */
+
 ///////////////////////////////////////////////////////////////////////////////
 // GLOBAL VARIABLES
 ///////////////////////////////////////////////////////////////////////////////
@@ -69,8 +78,8 @@ int main(int argc, char *argv[])
 
     TODO:
         (1) SCALING THE MAP TO 0-255
-        (2) ONLY COMPILE KERNEL ONCE
-        (3) NO UNNECESSARY TRANSFERS TO DEVICE
+        (2) ONLY COMPILE KERNEL ONCE (done)
+        (3) NO UNNECESSARY TRANSFERS TO DEVICE (done)
     */
     bool success;
     PerfTimer ptimer;
@@ -81,9 +90,13 @@ int main(int argc, char *argv[])
     unsigned int ccThreshold = 8;
     unsigned int downscaleFactor = 4;
 
+#if LOAD_AS_GRAYSCALE
+    Image *leftImg = new GrayImage();           // left stereo image
+    Image *rightImg = new GrayImage();          // right stereo image
+#else
     Image *leftImg = new Image();               // left stereo image
     Image *rightImg = new Image();              // right stereo image
-    GrayImage finalImg;                         // final image after cross-checking
+#endif
 
     // if an arguments are provided, use them as image name
     if (argc > 2)
@@ -111,17 +124,29 @@ int main(int argc, char *argv[])
     cout << "Image manipulation is done using " << computeDeviceStr() << "." << endl;
 
 #ifdef USE_OCL
-    double kernelTime;
-
     // initialize OpenCL if necessary
     MiniOCL ocl(kernelFileName);
-    ocl.initialize(TARGET_DEVICE_TYPE);
+    success = ocl.initialize(TARGET_DEVICE_TYPE);
+    CHECK_ERROR(success, "Error initializing OpenCL.")
     leftImg->setOpenCL(&ocl);
     rightImg->setOpenCL(&ocl);
-    finalImg.setOpenCL(&ocl);
 
     ocl.displayDeviceInfo();
 
+#if OCL_MULTI_DEVICE
+    // a context and a queue for every device for ZNCC
+    MultiOCL multi(kernelFileName);
+    success = multi.initialize(CL_DEVICE_TYPE_ALL) > 0;
+    CHECK_ERROR(success, "Error initializing the OpenCL devices.")
+    cout << "ZNCC is split across " << multi.devices.size() << " OpenCL device(s)." << endl;
+#endif /* OCL_MULTI_DEVICE */
+
+#endif /* USE_OCL */
+
+    // declared after MiniOCL, so that its device buffer is released first
+    GrayImage finalImg;                         // final image after cross-checking
+#ifdef USE_OCL
+    finalImg.setOpenCL(&ocl);
 #endif /* USE_OCL */
 
     // 1. Load both images from disk
@@ -138,15 +163,36 @@ int main(int argc, char *argv[])
     cout << "Right image '" << rightImgName << "', size "
          << rightImg->width << "x" << rightImg->height << "." << endl;
 
+#if FUSED_PIPELINE
+    // 2.-8. All the stages in one call (see FUSED_PIPELINE)
+
+    BEGIN_STAGE("stereo pipeline")
+    ptimer.reset();
+    success = leftImg->calcStereoDisparity(*rightImg, &finalImg, windowSize, maxSearchD, downscaleFactor, ccThreshold);
+    CHECK_ERROR(success, "Error in the stereo pipeline.")
+    ptimer.printTime();
+
+    delete leftImg;
+    delete rightImg;
+#else
     // 2. Downscale (resize) the both images
+    BEGIN_STAGE("downscale")
     ptimer.reset();
+#if FUSED_DOWNSCALE
+    success = leftImg->downScaleToGray(downscaleFactor);
+    CHECK_ERROR(success, "Error downscaling the left image.")
+    success = rightImg->downScaleToGray(downscaleFactor);
+    CHECK_ERROR(success, "Error downscaling the right image.")
+#else
     success = leftImg->downScale(downscaleFactor);
     CHECK_ERROR(success, "Error downscaling the left image.")
     success = rightImg->downScale(downscaleFactor);
     CHECK_ERROR(success, "Error downscaling the right image.")
+#endif
     ptimer.printTime();
 
     // 3. Convert both images to grayscale
+    BEGIN_STAGE("grayscale")
     ptimer.reset();
     success = leftImg->convertToGrayscale();
     CHECK_ERROR(success, "Error transforming the left image to grayscale.")
@@ -154,87 +200,120 @@ int main(int argc, char *argv[])
     CHECK_ERROR(success, "Error transforming the right image to grayscale.")
     ptimer.printTime();
 
-#ifdef USE_OCL
-    // print the actual kernel execution time
-    kernelTime = ocl.getExecutionTime();
-    printf("\t=> Right image kernel execution time: %0.3f ms \n", kernelTime / 1000.0f);
-#endif /* USE_OCL */
-
+#if SAVE_INTERMEDIATE_IMAGES
+    BEGIN_STAGE("save grayscale")
     ptimer.reset();
     success = leftImg->save("img/1-gray-l.png");
     CHECK_ERROR(success, "Error saving the left image to disk.")
     success = rightImg->save("img/1-gray-r.png");
     CHECK_ERROR(success, "Error saving the right image to disk.")
     ptimer.printTime();
+#endif /* SAVE_INTERMEDIATE_IMAGES */
 
+#if FUSED_CROSS_CHECK
+    // 4.-5. Calculate the cross-checked stereo disparity (ZNCC) in one pass
+
+    BEGIN_STAGE("zncc + cross-check")
+    ptimer.reset();
+    success = leftImg->calcZNCCCrossChecked(*rightImg, &finalImg, windowSize, maxSearchD, ccThreshold);
+    CHECK_ERROR(success, "Error calculating cross-checked ZNCC.")
+    ptimer.printTime();
+
+    // these have become unnecessary at this point
+    delete leftImg;
+    delete rightImg;
+#else
     // 4. Calculate stereo disparity (ZNCC) for both images
 
     Image *leftDispImg = new GrayImage();   // contains the left-to-right disparity map
     Image *rightDispImg = new GrayImage();  // contains the right-to-left disparity map
 
+    BEGIN_STAGE("zncc")
     ptimer.reset();
-    success = leftImg->calcZNCC(*rightImg, leftDispImg, windowSize, maxSearchD);
+#if defined(USE_OCL) && OCL_MULTI_DEVICE
+    success = leftImg->calcZNCCMulti(*rightImg, leftDispImg, windowSize, maxSearchD, multi);
     CHECK_ERROR(success, "Error calculating ZNCC for the left image.")
-    success = rightImg->calcZNCC(*leftImg, rightDispImg, windowSize, maxSearchD, true);
+    success = rightImg->calcZNCCMulti(*leftImg, rightDispImg, windowSize, maxSearchD, multi, true);
     CHECK_ERROR(success, "Error calculating ZNCC for the right image.")
+#else
+    success = leftImg->calcZNCCPair(*rightImg, leftDispImg, rightDispImg, windowSize, maxSearchD);
+    CHECK_ERROR(success, "Error calculating ZNCC.")
+#endif
     ptimer.printTime();
 
-#ifdef USE_OCL
-    // print the actual kernel execution time
-    kernelTime = ocl.getExecutionTime();
-    printf("\t=> Kernel execution time: %0.3f ms \n", kernelTime / 1000.0f);
-#endif /* USE_OCL */
-
     // these have become unnecessary at this point
     delete leftImg;
     delete rightImg;
 
+#if SAVE_INTERMEDIATE_IMAGES
+    BEGIN_STAGE("save disparity")
     ptimer.reset();
     success = leftDispImg->save("img/2-disparity-l.png");
     CHECK_ERROR(success, "Error saving the left image to disk.")
     success = rightDispImg->save("img/2-disparity-r.png");
     CHECK_ERROR(success, "Error saving the right image to disk.")
     ptimer.printTime();
+#endif /* SAVE_INTERMEDIATE_IMAGES */
 
     // 5. Cross-checking
 
+    BEGIN_STAGE("cross-check")
     ptimer.reset();
-    finalImg.crossCheck(*leftDispImg, *rightDispImg, ccThreshold);
+    success = finalImg.crossCheck(*leftDispImg, *rightDispImg, ccThreshold);
     CHECK_ERROR(success, "Error in cross checking.")
     ptimer.printTime();
 
-#ifdef USE_OCL
-    // print the actual kernel execution time
-    kernelTime = ocl.getExecutionTime();
-    printf("\t=> Kernel execution time: %0.3f ms \n", kernelTime / 1000.0f);
-#endif /* USE_OCL */
-
     // these have become unnecessary at this point
     delete leftDispImg;
     delete rightDispImg;
+#endif /* FUSED_CROSS_CHECK */
 
+#if SAVE_INTERMEDIATE_IMAGES
+    BEGIN_STAGE("save cross-checked")
     ptimer.reset();
     success = finalImg.save("img/3-cross-checked.png");
     CHECK_ERROR(success, "Error saving image to disk.")
     ptimer.printTime();
+#endif /* SAVE_INTERMEDIATE_IMAGES */
 
-    // 6. Occlusion filling
+    // 6. Speckle removal
 
+    BEGIN_STAGE("speckles")
+    ptimer.reset();
+    success = finalImg.removeSpeckles(SPECKLE_SIZE, SPECKLE_TOLERANCE);
+    CHECK_ERROR(success, "Error in speckle removal.")
+    ptimer.printTime();
+
+    // 7. Occlusion filling
+
+    BEGIN_STAGE("occlusion fill")
     ptimer.reset();
     success = finalImg.occlusionFill();
     CHECK_ERROR(success, "Error in occlusion filling.")
     ptimer.printTime();
 
-#ifdef USE_OCL
-    // print the actual kernel execution time
-    kernelTime = ocl.getExecutionTime();
-    printf("\t=> Kernel execution time: %0.3f ms \n", kernelTime / 1000.0f);
-#endif /* USE_OCL */
+    // 8. Median filtering
 
+    BEGIN_STAGE("median")
+    ptimer.reset();
+    success = finalImg.filterMedian(MEDIAN_RADIUS);
+    CHECK_ERROR(success, "Error in median filtering.")
+    ptimer.printTime();
+#endif /* FUSED_PIPELINE */
+
+    BEGIN_STAGE("save result")
     ptimer.reset();
     success = finalImg.save("img/4-occlusion-filled.png");
     CHECK_ERROR(success, "Error saving image to disk.")
     ptimer.printTime();
 
+#ifdef USE_OCL
+    // device time of each stage, including the transfers
+    ocl.printProfile();
+    if (strlen(OCL_PROFILE_FILE) > 0)
+        ocl.exportProfile(OCL_PROFILE_FILE);
+    ocl.resetProfile();
+#endif /* USE_OCL */
+
     return EXIT_SUCCESS;
 }